@@ -3,6 +3,7 @@
 %include "std_vector.i"
 %include <std_string.i>
 %include <std_wstring.i>
+%include <stdint.i>
 
 // Instantiate templates used by example
 namespace std {
@@ -14,4 +15,5 @@ namespace std {
 %{
 #include "jamspell/spell_corrector.hpp"
 %}
+%include "jamspell/lru_cache.hpp"
 %include "jamspell/spell_corrector.hpp"
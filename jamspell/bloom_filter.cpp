@@ -1,16 +1,22 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
+#include <limits>
 
 #include "bloom_filter.hpp"
+#include "gram_key.hpp"
 
 #include <contrib/bloom/bloom_filter.hpp>
+#include <contrib/cityhash/city.h>
 #include <contrib/handypack/handypack.hpp>
 
 namespace NJamSpell {
 
 struct TBloomFilter::Impl: public bloom_filter {
     Impl(): bloom_filter() {}
-    Impl(const bloom_parameters& params): bloom_filter(params) {}
-    Impl(const TBloomFilter::Impl& bloomFilter): bloom_filter(bloomFilter) {}
+    Impl(const bloom_parameters& params): bloom_filter(params) { UpdateTable(); }
+    Impl(const TBloomFilter::Impl& bloomFilter): bloom_filter(bloomFilter) { UpdateTable(); }
     ~Impl() {}
     void Dump(std::ostream& out) const {
         NHandyPack::Dump(out, salt_, bit_table_, salt_count_, table_size_,
@@ -21,6 +27,61 @@ struct TBloomFilter::Impl: public bloom_filter {
         NHandyPack::Load(in, salt_, bit_table_, salt_count_, table_size_,
                         projected_element_count_, inserted_element_count_,
                         random_seed_, desired_false_positive_probability_);
+        UpdateTable();
+    }
+    void DumpParams(std::ostream& out) const {
+        NHandyPack::Dump(out, salt_, salt_count_, table_size_,
+                        projected_element_count_, inserted_element_count_,
+                        random_seed_, desired_false_positive_probability_);
+    }
+    void LoadParams(std::istream& in) {
+        NHandyPack::Load(in, salt_, salt_count_, table_size_,
+                        projected_element_count_, inserted_element_count_,
+                        random_seed_, desired_false_positive_probability_);
+        table_type().swap(bit_table_);
+        Table = nullptr;
+    }
+    size_t TableSize() const {
+        return table_size_ / bits_per_char;
+    }
+    void SetTable(const unsigned char* table) {
+        table_type().swap(bit_table_);
+        Table = table;
+    }
+    // Same as bloom_filter::insert, but bits are set atomically
+    void InsertConcurrent(const unsigned char* key_begin, const std::size_t length) {
+        static_assert(sizeof(std::atomic<unsigned char>) == 1, "atomic bytes are expected to be plain bytes");
+        std::atomic<unsigned char>* table = reinterpret_cast<std::atomic<unsigned char>*>(&bit_table_[0]);
+        std::size_t bit_index = 0;
+        std::size_t bit = 0;
+        for (std::size_t i = 0; i < salt_.size(); ++i) {
+            compute_indices(hash_ap(key_begin, length, salt_[i]), bit_index, bit);
+            table[bit_index / bits_per_char].fetch_or(bit_mask[bit], std::memory_order_relaxed);
+        }
+        ConcurrentInserted.fetch_add(1, std::memory_order_relaxed);
+    }
+    void FinishConcurrent() {
+        inserted_element_count_ += ConcurrentInserted.exchange(0);
+    }
+    // Same as bloom_filter::contains, but reads a table that may be external
+    bool contains(const unsigned char* key_begin, const std::size_t length) const override {
+        std::size_t bit_index = 0;
+        std::size_t bit = 0;
+        for (std::size_t i = 0; i < salt_.size(); ++i) {
+            compute_indices(hash_ap(key_begin, length, salt_[i]), bit_index, bit);
+            if ((Table[bit_index / bits_per_char] & bit_mask[bit]) != bit_mask[bit]) {
+                return false;
+            }
+        }
+        return true;
+    }
+    using bloom_filter::contains;
+
+    const unsigned char* Table = nullptr;
+    std::atomic<uint64_t> ConcurrentInserted{0};
+private:
+    void UpdateTable() {
+        Table = bit_table_.empty() ? nullptr : &bit_table_[0];
     }
 };
 
@@ -28,27 +89,59 @@ TBloomFilter::TBloomFilter() {
     BloomFilter.reset(new TBloomFilter::Impl());
 }
 
-TBloomFilter::TBloomFilter(uint64_t elements, double falsePositiveRate) {
+static bloom_parameters BloomParameters(uint64_t elements, double falsePositiveRate) {
     bloom_parameters parameters;
     parameters.projected_element_count = elements;
     parameters.false_positive_probability = falsePositiveRate;
     parameters.random_seed = 42;
     parameters.compute_optimal_parameters();
     assert(!(!parameters));
-    BloomFilter.reset(new TBloomFilter::Impl(parameters));
+    return parameters;
+}
+
+TBloomFilter::TBloomFilter(uint64_t elements, double falsePositiveRate) {
+    BloomFilter.reset(new TBloomFilter::Impl(BloomParameters(elements, falsePositiveRate)));
+}
+
+uint64_t TBloomFilter::TableSizeFor(uint64_t elements, double falsePositiveRate) {
+    return BloomParameters(elements, falsePositiveRate).optimal_parameters.table_size / bits_per_char;
 }
 
 TBloomFilter::~TBloomFilter() {
 }
 
 void TBloomFilter::Insert(const std::string& element) {
+    assert(BloomFilter->Table == &BloomFilter->table()[0] && "Mapped filter is read-only");
     BloomFilter->insert(element);
 }
 
+void TBloomFilter::Insert(const char* data, size_t size) {
+    assert(BloomFilter->Table == &BloomFilter->table()[0] && "Mapped filter is read-only");
+    BloomFilter->insert(data, size);
+}
+
+bool TBloomFilter::ConcurrentInsert() const {
+    return true;
+}
+
+void TBloomFilter::InsertConcurrent(const char* data, size_t size) {
+    assert(BloomFilter->Table == &BloomFilter->table()[0] && "Mapped filter is read-only");
+    BloomFilter->InsertConcurrent((const unsigned char*)data, size);
+}
+
+bool TBloomFilter::Finish() {
+    BloomFilter->FinishConcurrent();
+    return true;
+}
+
 bool TBloomFilter::Contains(const std::string& element) const {
     return BloomFilter->contains(element);
 }
 
+bool TBloomFilter::Contains(const char* data, size_t size) const {
+    return BloomFilter->contains(data, size);
+}
+
 void TBloomFilter::Dump(std::ostream& out) const {
     BloomFilter->Dump(out);
 }
@@ -57,4 +150,133 @@ void TBloomFilter::Load(std::istream& in) {
     BloomFilter->Load(in);
 }
 
+void TBloomFilter::DumpParams(std::ostream& out) const {
+    BloomFilter->DumpParams(out);
+}
+
+void TBloomFilter::LoadParams(std::istream& in) {
+    BloomFilter->LoadParams(in);
+}
+
+const char* TBloomFilter::TableData() const {
+    return (const char*)BloomFilter->Table;
+}
+
+size_t TBloomFilter::TableSize() const {
+    return BloomFilter->TableSize();
+}
+
+void TBloomFilter::SetTable(const char* data) {
+    BloomFilter->SetTable((const unsigned char*)data);
+}
+
+constexpr uint64_t BLOCK_BITS = 512;
+constexpr uint64_t BLOCK_WORDS = BLOCK_BITS / 64;
+constexpr uint32_t BLOCK_BIT_SHIFT = 32 - 9; // top 9 bits of a 32-bit hash address a bit in a block
+
+// Keys are not spread evenly over blocks, so crowded blocks give more false
+// positives than a classic filter of the same size; extra space makes up for it.
+constexpr double BLOCKED_BLOOM_SIZE_FACTOR = 1.15;
+
+static uint32_t BlockedBloomHashes(double falsePositiveRate) {
+    assert(falsePositiveRate > 0.0 && falsePositiveRate < 1.0);
+    return uint32_t(std::max(1.0, std::round(-std::log2(falsePositiveRate))));
+}
+
+static uint64_t BlockedBloomBlocks(uint64_t elements, uint32_t hashes) {
+    double bits = double(std::max<uint64_t>(elements, 1)) * hashes / std::log(2.0) * BLOCKED_BLOOM_SIZE_FACTOR;
+    return std::max<uint64_t>(uint64_t(std::ceil(bits / BLOCK_BITS)), 1);
+}
+
+TBlockedBloomFilter::TBlockedBloomFilter(uint64_t elements, double falsePositiveRate) {
+    HashesNumber = BlockedBloomHashes(falsePositiveRate);
+    BlocksNumber = BlockedBloomBlocks(elements, HashesNumber);
+    assert(BlocksNumber <= std::numeric_limits<uint32_t>::max());
+    Storage.assign(BlocksNumber * BLOCK_WORDS + BLOCK_WORDS - 1, 0);
+    const uint64_t* data = &Storage[0];
+    size_t misalignment = (uintptr_t(data) / sizeof(uint64_t)) % BLOCK_WORDS;
+    Table = data + (misalignment ? BLOCK_WORDS - misalignment : 0);
+}
+
+uint64_t TBlockedBloomFilter::TableSizeFor(uint64_t elements, double falsePositiveRate) {
+    return BlockedBloomBlocks(elements, BlockedBloomHashes(falsePositiveRate)) * BLOCK_WORDS * sizeof(uint64_t);
+}
+
+uint64_t TBlockedBloomFilter::BlockIndex(uint64_t hash) const {
+    return ((hash >> 32) * BlocksNumber) >> 32;
+}
+
+template<bool Concurrent>
+void TBlockedBloomFilter::InsertHash(uint64_t hash) {
+    static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "atomic words are expected to be plain words");
+    uint64_t* block = const_cast<uint64_t*>(Table) + BlockIndex(hash) * BLOCK_WORDS;
+    uint64_t bits = MixHash64(hash);
+    uint32_t a = uint32_t(bits);
+    uint32_t b = uint32_t(bits >> 32) | 1;
+    for (uint32_t i = 0; i < HashesNumber; ++i, a += b) {
+        uint32_t bit = a >> BLOCK_BIT_SHIFT;
+        uint64_t mask = uint64_t(1) << (bit % 64);
+        if (Concurrent) {
+            reinterpret_cast<std::atomic<uint64_t>*>(block)[bit / 64].fetch_or(mask, std::memory_order_relaxed);
+        } else {
+            block[bit / 64] |= mask;
+        }
+    }
+}
+
+void TBlockedBloomFilter::Insert(const char* data, size_t size) {
+    assert(!Storage.empty() && "Mapped filter is read-only");
+    InsertHash<false>(CityHash64(data, size));
+}
+
+bool TBlockedBloomFilter::ConcurrentInsert() const {
+    return true;
+}
+
+void TBlockedBloomFilter::InsertConcurrent(const char* data, size_t size) {
+    assert(!Storage.empty() && "Mapped filter is read-only");
+    InsertHash<true>(CityHash64(data, size));
+}
+
+bool TBlockedBloomFilter::Contains(const char* data, size_t size) const {
+    if (BlocksNumber == 0) {
+        return false;
+    }
+    uint64_t hash = CityHash64(data, size);
+    const uint64_t* block = Table + BlockIndex(hash) * BLOCK_WORDS;
+    uint64_t bits = MixHash64(hash);
+    uint32_t a = uint32_t(bits);
+    uint32_t b = uint32_t(bits >> 32) | 1;
+    for (uint32_t i = 0; i < HashesNumber; ++i, a += b) {
+        uint32_t bit = a >> BLOCK_BIT_SHIFT;
+        if (!(block[bit / 64] & (uint64_t(1) << (bit % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void TBlockedBloomFilter::DumpParams(std::ostream& out) const {
+    NHandyPack::Dump(out, BlocksNumber, HashesNumber);
+}
+
+void TBlockedBloomFilter::LoadParams(std::istream& in) {
+    NHandyPack::Load(in, BlocksNumber, HashesNumber);
+    std::vector<uint64_t>().swap(Storage);
+    Table = nullptr;
+}
+
+const char* TBlockedBloomFilter::TableData() const {
+    return (const char*)Table;
+}
+
+size_t TBlockedBloomFilter::TableSize() const {
+    return BlocksNumber * BLOCK_WORDS * sizeof(uint64_t);
+}
+
+void TBlockedBloomFilter::SetTable(const char* data) {
+    std::vector<uint64_t>().swap(Storage);
+    Table = (const uint64_t*)data;
+}
+
 } // NJamSpell
@@ -1,21 +1,68 @@
 #pragma once
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
+
+#include "string_filter.hpp"
 
 namespace NJamSpell {
 
-class TBloomFilter {
+// Classic bloom filter (contrib/bloom): each hash function probes a bit
+// anywhere in the table.
+class TBloomFilter: public TStringFilter {
 public:
     TBloomFilter();
     TBloomFilter(uint64_t elements, double falsePositiveRate);
     ~TBloomFilter();
+    static uint64_t TableSizeFor(uint64_t elements, double falsePositiveRate);
     void Insert(const std::string& element);
+    void Insert(const char* data, size_t size) override;
+    bool ConcurrentInsert() const override;
+    void InsertConcurrent(const char* data, size_t size) override;
+    bool Finish() override;
     bool Contains(const std::string& element) const;
+    bool Contains(const char* data, size_t size) const override;
     void Dump(std::ostream& out) const;
     void Load(std::istream& in);
+
+    void DumpParams(std::ostream& out) const override;
+    void LoadParams(std::istream& in) override;
+    const char* TableData() const override;
+    size_t TableSize() const override;
+    void SetTable(const char* data) override;
 private:
     struct Impl;
     std::unique_ptr<Impl> BloomFilter;
 };
 
+// Blocked bloom filter: a key hashes to one 64-byte block (a cache line)
+// and all its bits are set within that block, so a lookup is a single hash
+// of the key and at most one cache miss.
+class TBlockedBloomFilter: public TStringFilter {
+public:
+    TBlockedBloomFilter() = default;
+    TBlockedBloomFilter(uint64_t elements, double falsePositiveRate);
+    static uint64_t TableSizeFor(uint64_t elements, double falsePositiveRate);
+    void Insert(const char* data, size_t size) override;
+    bool ConcurrentInsert() const override;
+    void InsertConcurrent(const char* data, size_t size) override;
+    bool Contains(const char* data, size_t size) const override;
+
+    void DumpParams(std::ostream& out) const override;
+    void LoadParams(std::istream& in) override;
+    const char* TableData() const override;
+    size_t TableSize() const override;
+    void SetTable(const char* data) override;
+private:
+    uint64_t BlockIndex(uint64_t hash) const;
+    template<bool Concurrent>
+    void InsertHash(uint64_t hash);
+private:
+    uint64_t BlocksNumber = 0;
+    uint32_t HashesNumber = 0;
+    std::vector<uint64_t> Storage; // owned table with room for alignment
+    const uint64_t* Table = nullptr;
+};
+
 } // NJamSpell
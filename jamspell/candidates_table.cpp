@@ -0,0 +1,133 @@
+#include <sstream>
+
+#include <contrib/handypack/handypack.hpp>
+
+#include "candidates_table.hpp"
+
+namespace NJamSpell {
+
+constexpr uint64_t CANDIDATES_TABLE_MAGIC_BYTE = 8147209462953110127L;
+constexpr uint16_t CANDIDATES_TABLE_VERSION = 2; // candidates engine
+
+constexpr uint32_t CANDIDATES_TABLE_SECTION_META = 1;
+constexpr uint32_t CANDIDATES_TABLE_SECTION_POOL = 2;
+constexpr uint32_t CANDIDATES_TABLE_SECTION_WORD_OFFSETS = 3;
+constexpr uint32_t CANDIDATES_TABLE_SECTION_INDEX = 4;
+constexpr uint32_t CANDIDATES_TABLE_SECTION_OFFSETS = 5;
+constexpr uint32_t CANDIDATES_TABLE_SECTION_IDS = 6;
+constexpr uint32_t CANDIDATES_TABLE_SECTION_FLAGS = 7;
+
+constexpr uint8_t CANDIDATES_TABLE_FIRST_LEVEL = 1;
+constexpr uint8_t CANDIDATES_TABLE_KNOWN_WORD = 2;
+
+void TCandidatesTable::Build(const std::vector<std::pair<std::wstring, TWordCandidates>>& words,
+                             uint64_t maxCandidatesToCheck, uint16_t candidatesEngine)
+{
+    File.reset();
+    Words.Clear();
+    std::vector<uint32_t> offsets(1, 0);
+    std::vector<TWordId> ids;
+    std::vector<uint8_t> flags;
+    for (auto&& w: words) {
+        if (Words.Add(w.first.data(), w.first.size()) != offsets.size() - 1) {
+            continue; // duplicate
+        }
+        ids.insert(ids.end(), w.second.Ids.begin(), w.second.Ids.end());
+        offsets.push_back(ids.size());
+        flags.push_back((w.second.FirstLevel ? CANDIDATES_TABLE_FIRST_LEVEL : 0) |
+                        (w.second.KnownWord ? CANDIDATES_TABLE_KNOWN_WORD : 0));
+    }
+    MaxCandidatesToCheck = maxCandidatesToCheck;
+    CandidatesEngine = candidatesEngine;
+    Offsets.Assign(std::move(offsets));
+    Ids.Assign(std::move(ids));
+    Flags.Assign(std::move(flags));
+}
+
+bool TCandidatesTable::Find(const wchar_t* word, size_t len, TWordCandidates& result) const {
+    TWordId wid = Words.Find(word, len);
+    if (wid == UNKNOWN_WORD_ID) {
+        return false;
+    }
+    result.Ids.assign(Ids.begin() + Offsets[wid], Ids.begin() + Offsets[wid + 1]);
+    result.FirstLevel = Flags[wid] & CANDIDATES_TABLE_FIRST_LEVEL;
+    result.KnownWord = Flags[wid] & CANDIDATES_TABLE_KNOWN_WORD;
+    return true;
+}
+
+TWordId TCandidatesTable::Size() const {
+    return Words.Size();
+}
+
+uint64_t TCandidatesTable::GetMaxCandidatesToCheck() const {
+    return MaxCandidatesToCheck;
+}
+
+uint16_t TCandidatesTable::GetCandidatesEngine() const {
+    return CandidatesEngine;
+}
+
+bool TCandidatesTable::Dump(const std::string& fileName, uint64_t checkSum) const {
+    std::stringbuf metaBuf;
+    std::ostream meta(&metaBuf);
+    uint16_t wcharSize = sizeof(wchar_t);
+    NHandyPack::Dump(meta, checkSum, wcharSize, MaxCandidatesToCheck, CandidatesEngine);
+
+    TSectionsWriter writer;
+    writer.Add(CANDIDATES_TABLE_SECTION_META, metaBuf.str());
+    Words.Dump(writer, CANDIDATES_TABLE_SECTION_POOL, CANDIDATES_TABLE_SECTION_WORD_OFFSETS, CANDIDATES_TABLE_SECTION_INDEX);
+    writer.Add(CANDIDATES_TABLE_SECTION_OFFSETS, Offsets);
+    writer.Add(CANDIDATES_TABLE_SECTION_IDS, Ids);
+    writer.Add(CANDIDATES_TABLE_SECTION_FLAGS, Flags);
+    return writer.Write(fileName, CANDIDATES_TABLE_MAGIC_BYTE, CANDIDATES_TABLE_VERSION);
+}
+
+bool TCandidatesTable::Load(const std::string& fileName, uint64_t checkSum) {
+    std::unique_ptr<TMappedSections> file(new TMappedSections());
+    if (!file->Open(fileName, CANDIDATES_TABLE_MAGIC_BYTE, CANDIDATES_TABLE_VERSION)) {
+        return false;
+    }
+    const char* meta = nullptr;
+    size_t metaSize = 0;
+    if (!file->Get(CANDIDATES_TABLE_SECTION_META, meta, metaSize)) {
+        return false;
+    }
+    NHandyPack::imemstream in(meta, metaSize);
+    uint64_t fileCheckSum = 0;
+    uint16_t wcharSize = 0;
+    uint64_t maxCandidatesToCheck = 0;
+    uint16_t candidatesEngine = 0;
+    NHandyPack::Load(in, fileCheckSum, wcharSize, maxCandidatesToCheck, candidatesEngine);
+    if (!in || fileCheckSum != checkSum || wcharSize != sizeof(wchar_t)) {
+        return false;
+    }
+
+    TFlatArray<uint32_t> offsets;
+    TFlatArray<TWordId> ids;
+    TFlatArray<uint8_t> flags;
+    if (!Words.Load(*file, CANDIDATES_TABLE_SECTION_POOL, CANDIDATES_TABLE_SECTION_WORD_OFFSETS, CANDIDATES_TABLE_SECTION_INDEX) ||
+        !file->Get(CANDIDATES_TABLE_SECTION_OFFSETS, offsets) ||
+        !file->Get(CANDIDATES_TABLE_SECTION_IDS, ids) ||
+        !file->Get(CANDIDATES_TABLE_SECTION_FLAGS, flags) ||
+        offsets.size() != size_t(Words.Size()) + 1 ||
+        flags.size() != Words.Size() ||
+        offsets[offsets.size() - 1] != ids.size())
+    {
+        Words.Clear();
+        Offsets.Clear();
+        Ids.Clear();
+        Flags.Clear();
+        File.reset();
+        return false;
+    }
+
+    MaxCandidatesToCheck = maxCandidatesToCheck;
+    CandidatesEngine = candidatesEngine;
+    Offsets.View(offsets.data(), offsets.size());
+    Ids.View(ids.data(), ids.size());
+    Flags.View(flags.data(), flags.size());
+    File = std::move(file);
+    return true;
+}
+
+} // NJamSpell
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "lang_model.hpp"
+#include "vocabulary.hpp"
+#include "mapped_file.hpp"
+
+namespace NJamSpell {
+
+// Candidates of a word before they are scored in context
+struct TWordCandidates {
+    TWordIds Ids; // UNKNOWN_WORD_ID is the word itself, if it's not in vocabulary
+    bool FirstLevel = true;
+    bool KnownWord = false;
+};
+
+// Candidates precomputed for frequent words (usually common misspellings),
+// stored next to the model and used in place, so these words never pay for
+// candidates generation. Words are kept in a vocabulary of their own; its ids
+// index the candidates.
+class TCandidatesTable {
+public:
+    void Build(const std::vector<std::pair<std::wstring, TWordCandidates>>& words, uint64_t maxCandidatesToCheck,
+               uint16_t candidatesEngine);
+    bool Find(const wchar_t* word, size_t len, TWordCandidates& result) const;
+    TWordId Size() const;
+    // Candidates depend on the corrector settings, they are only valid for the same values
+    uint64_t GetMaxCandidatesToCheck() const;
+    uint16_t GetCandidatesEngine() const;
+
+    bool Dump(const std::string& fileName, uint64_t checkSum) const;
+    bool Load(const std::string& fileName, uint64_t checkSum);
+private:
+    uint64_t MaxCandidatesToCheck = 0;
+    uint16_t CandidatesEngine = 0;
+    TVocabulary Words;
+    TFlatArray<uint32_t> Offsets; // word -> first candidate, Words.Size() + 1 items
+    TFlatArray<TWordId> Ids;
+    TFlatArray<uint8_t> Flags;    // word -> FirstLevel | KnownWord << 1
+    std::unique_ptr<TMappedSections> File;
+};
+
+} // NJamSpell
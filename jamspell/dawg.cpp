@@ -0,0 +1,358 @@
+#include <algorithm>
+#include <cassert>
+#include <sstream>
+#include <unordered_map>
+
+#include <contrib/handypack/handypack.hpp>
+
+#include "dawg.hpp"
+
+namespace NJamSpell {
+
+constexpr uint64_t DAWG_MAGIC_BYTE = 5360811927441053573L;
+constexpr uint16_t DAWG_VERSION = 1;
+
+constexpr uint32_t DAWG_SECTION_META = 1;
+constexpr uint32_t DAWG_SECTION_STATES = 2;
+constexpr uint32_t DAWG_SECTION_EDGES = 3;
+constexpr uint32_t DAWG_SECTION_IDS = 4;
+constexpr uint32_t DAWG_SECTION_RANKS = 5;
+
+namespace {
+
+struct TBuildState {
+    bool Final = false;
+    std::vector<std::pair<uint32_t, uint32_t>> Edges; // label, target
+};
+
+// Incremental construction from sorted words (Daciuk et al.): only states
+// on the path of the last added word may still change, all others are
+// already replaced by their registered equivalents.
+class TDawgBuilder {
+public:
+    TDawgBuilder()
+        : States(1)
+        , Path(1, 0)
+    {
+    }
+    void Add(const std::wstring& word) {
+        size_t prefix = 0;
+        while (prefix < word.size() && prefix < Previous.size() && word[prefix] == Previous[prefix]) {
+            ++prefix;
+        }
+        Minimize(prefix);
+        for (size_t i = prefix; i < word.size(); ++i) {
+            uint32_t state = States.size();
+            States.emplace_back();
+            States[Path.back()].Edges.push_back(std::make_pair(uint32_t(word[i]), state));
+            Path.push_back(state);
+        }
+        States[Path.back()].Final = true;
+        Previous = word;
+    }
+    void Finish() {
+        Minimize(0);
+    }
+    std::vector<TBuildState> States; // 0 is root, unreachable states are left behind
+private:
+    void Minimize(size_t depth) {
+        while (Path.size() > depth + 1) {
+            uint32_t state = Path.back();
+            Path.pop_back();
+            std::string signature = Signature(States[state]);
+            auto it = Register.find(signature);
+            if (it != Register.end()) {
+                States[Path.back()].Edges.back().second = it->second;
+                States[state] = TBuildState();
+            } else {
+                Register[signature] = state;
+            }
+        }
+    }
+    static std::string Signature(const TBuildState& state) {
+        std::string result(1, state.Final ? '\1' : '\0');
+        result.append((const char*)state.Edges.data(), state.Edges.size() * sizeof(state.Edges[0]));
+        return result;
+    }
+    std::wstring Previous;
+    std::vector<uint32_t> Path; // unregistered states of the previous word, from root
+    std::unordered_map<std::string, uint32_t> Register;
+};
+
+uint32_t CountWords(const std::vector<TBuildState>& states, uint32_t state, std::vector<uint32_t>& counts) {
+    if (counts[state] == uint32_t(-1)) {
+        uint32_t count = states[state].Final ? 1 : 0;
+        for (auto&& e: states[state].Edges) {
+            count += CountWords(states, e.second, counts);
+        }
+        counts[state] = count;
+    }
+    return counts[state];
+}
+
+} // namespace
+
+void TDawg::Build(const TLangModel& model) {
+    TWordId wordsNumber = model.GetWordsNumber();
+    std::vector<std::pair<std::wstring, TWordId>> words;
+    words.reserve(wordsNumber);
+    for (TWordId wid = 0; wid < wordsNumber; ++wid) {
+        TWord word = model.GetWordById(wid);
+        words.push_back(std::make_pair(std::wstring(word.Ptr, word.Len), wid));
+    }
+    std::sort(words.begin(), words.end());
+
+    TDawgBuilder builder;
+    std::vector<TWordId> ids;
+    std::vector<TWordId> ranks(wordsNumber, UNKNOWN_WORD_ID);
+    const std::wstring* previous = nullptr;
+    for (auto&& w: words) {
+        if (w.first.empty() || (previous && w.first == *previous)) {
+            continue;
+        }
+        previous = &w.first;
+        ranks[w.second] = ids.size();
+        ids.push_back(w.second);
+        builder.Add(w.first);
+    }
+    builder.Finish();
+    const std::vector<TBuildState>& built = builder.States;
+
+    // Number reachable states in depth-first order
+    std::vector<uint32_t> numbers(built.size(), uint32_t(-1));
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> stack(1, 0);
+    while (!stack.empty()) {
+        uint32_t state = stack.back();
+        stack.pop_back();
+        if (numbers[state] != uint32_t(-1)) {
+            continue;
+        }
+        numbers[state] = order.size();
+        order.push_back(state);
+        for (auto it = built[state].Edges.rbegin(); it != built[state].Edges.rend(); ++it) {
+            stack.push_back(it->second);
+        }
+    }
+    std::vector<uint32_t> counts(built.size(), uint32_t(-1));
+    CountWords(built, 0, counts);
+
+    std::vector<uint32_t> states;
+    std::vector<TEdge> edges;
+    states.reserve(order.size() + 1);
+    for (uint32_t state: order) {
+        const TBuildState& s = built[state];
+        states.push_back((uint32_t(edges.size()) << 1) | (s.Final ? 1 : 0));
+        uint32_t rank = s.Final ? 1 : 0;
+        for (auto&& e: s.Edges) {
+            edges.push_back({e.first, numbers[e.second], rank});
+            rank += counts[e.second];
+        }
+    }
+    states.push_back(uint32_t(edges.size()) << 1);
+    assert(counts[0] == ids.size());
+
+    File.reset();
+    States.Assign(std::move(states));
+    Edges.Assign(std::move(edges));
+    Ids.Assign(std::move(ids));
+    Ranks.Assign(std::move(ranks));
+}
+
+uint32_t TDawg::EdgesBegin(uint32_t state) const {
+    return States[state] >> 1;
+}
+
+uint32_t TDawg::EdgesEnd(uint32_t state) const {
+    return States[state + 1] >> 1;
+}
+
+bool TDawg::IsFinal(uint32_t state) const {
+    return States[state] & 1;
+}
+
+// Returns the edge index or Edges.size() if there is no such edge
+uint32_t TDawg::FindEdge(uint32_t state, wchar_t label) const {
+    const TEdge* begin = Edges.begin() + EdgesBegin(state);
+    const TEdge* end = Edges.begin() + EdgesEnd(state);
+    const TEdge* it = std::lower_bound(begin, end, uint32_t(label), [](const TEdge& e, uint32_t label) {
+        return e.Label < label;
+    });
+    if (it == end || it->Label != uint32_t(label)) {
+        return Edges.size();
+    }
+    return it - Edges.begin();
+}
+
+TWordId TDawg::Find(const wchar_t* word, size_t len) const {
+    if (States.empty() || len == 0) {
+        return UNKNOWN_WORD_ID;
+    }
+    uint32_t state = 0;
+    uint32_t rank = 0;
+    for (size_t i = 0; i < len; ++i) {
+        uint32_t edge = FindEdge(state, word[i]);
+        if (edge == Edges.size()) {
+            return UNKNOWN_WORD_ID;
+        }
+        rank += Edges[edge].Rank;
+        state = Edges[edge].Target;
+    }
+    if (!IsFinal(state)) {
+        return UNKNOWN_WORD_ID;
+    }
+    return Ids[rank];
+}
+
+std::wstring TDawg::GetWord(TWordId wid) const {
+    std::wstring result;
+    if (wid >= Ranks.size() || Ranks[wid] == UNKNOWN_WORD_ID) {
+        return result;
+    }
+    uint32_t rank = Ranks[wid];
+    uint32_t state = 0;
+    while (!(IsFinal(state) && rank == 0)) {
+        const TEdge* begin = Edges.begin() + EdgesBegin(state);
+        const TEdge* end = Edges.begin() + EdgesEnd(state);
+        const TEdge* edge = std::upper_bound(begin, end, rank, [](uint32_t rank, const TEdge& e) {
+            return rank < e.Rank;
+        }) - 1;
+        rank -= edge->Rank;
+        result.push_back(wchar_t(edge->Label));
+        state = edge->Target;
+    }
+    return result;
+}
+
+TWordId TDawg::Size() const {
+    return Ids.size();
+}
+
+void TDawg::FindCandidates(const wchar_t* word, size_t len, size_t maxDistance, TWordIds& result) const {
+    if (States.empty()) {
+        return;
+    }
+    const size_t width = len + 1;
+    const size_t maxDepth = len + maxDistance;
+    std::vector<size_t> rows((maxDepth + 1) * width); // rows[depth] - distances to word prefixes
+    std::vector<uint32_t> labels(maxDepth + 1);
+    for (size_t j = 0; j < width; ++j) {
+        rows[j] = j;
+    }
+
+    struct TFrame {
+        uint32_t Edge;
+        uint32_t End;
+        uint32_t Rank;
+    };
+    std::vector<TFrame> stack;
+    stack.push_back({EdgesBegin(0), EdgesEnd(0), 0});
+    while (!stack.empty()) {
+        TFrame& frame = stack.back();
+        if (frame.Edge == frame.End) {
+            stack.pop_back();
+            continue;
+        }
+        const TEdge& edge = Edges[frame.Edge++];
+        const size_t depth = stack.size(); // of the edge target
+        const size_t* prev = &rows[(depth - 1) * width];
+        size_t* row = &rows[depth * width];
+        labels[depth] = edge.Label;
+        // only cells within maxDistance of the diagonal may be small enough,
+        // the ones next to this band are treated as too far
+        const size_t first = depth > maxDistance ? depth - maxDistance : 1;
+        const size_t last = std::min(len, depth + maxDistance);
+        row[0] = depth;
+        row[first - 1] = first == 1 ? depth : maxDistance + 1;
+        if (last < len) {
+            row[last + 1] = maxDistance + 1;
+        }
+        size_t best = row[first - 1];
+        for (size_t j = first; j <= last; ++j) {
+            size_t cost = uint32_t(word[j - 1]) == edge.Label ? 0 : 1;
+            size_t d = std::min(std::min(prev[j] + 1, row[j - 1] + 1), prev[j - 1] + cost);
+            if (depth > 1 && j > 1 && uint32_t(word[j - 2]) == edge.Label && uint32_t(word[j - 1]) == labels[depth - 1]) {
+                d = std::min(d, rows[(depth - 2) * width + j - 2] + 1);
+            }
+            row[j] = d;
+            best = std::min(best, d);
+        }
+        if (best > maxDistance) {
+            continue;
+        }
+        uint32_t rank = frame.Rank + edge.Rank;
+        if (IsFinal(edge.Target) && last == len && row[len] <= maxDistance) {
+            result.push_back(Ids[rank]);
+        }
+        if (depth < maxDepth) {
+            stack.push_back({EdgesBegin(edge.Target), EdgesEnd(edge.Target), rank});
+        }
+    }
+}
+
+size_t TDawg::MemoryUsage() const {
+    return States.size() * sizeof(uint32_t) +
+           Edges.size() * sizeof(TEdge) +
+           Ids.size() * sizeof(TWordId) +
+           Ranks.size() * sizeof(TWordId);
+}
+
+bool TDawg::Dump(const std::string& fileName, uint64_t checkSum) const {
+    if (States.empty()) {
+        return false;
+    }
+    std::stringbuf metaBuf;
+    std::ostream meta(&metaBuf);
+    uint16_t wcharSize = sizeof(wchar_t);
+    NHandyPack::Dump(meta, checkSum, wcharSize);
+
+    TSectionsWriter writer;
+    writer.Add(DAWG_SECTION_META, metaBuf.str());
+    writer.Add(DAWG_SECTION_STATES, States);
+    writer.Add(DAWG_SECTION_EDGES, Edges);
+    writer.Add(DAWG_SECTION_IDS, Ids);
+    writer.Add(DAWG_SECTION_RANKS, Ranks);
+    return writer.Write(fileName, DAWG_MAGIC_BYTE, DAWG_VERSION);
+}
+
+bool TDawg::Load(const std::string& fileName, uint64_t checkSum) {
+    std::unique_ptr<TMappedSections> file(new TMappedSections());
+    if (!file->Open(fileName, DAWG_MAGIC_BYTE, DAWG_VERSION)) {
+        return false;
+    }
+    const char* meta = nullptr;
+    size_t metaSize = 0;
+    if (!file->Get(DAWG_SECTION_META, meta, metaSize)) {
+        return false;
+    }
+    NHandyPack::imemstream in(meta, metaSize);
+    uint64_t fileCheckSum = 0;
+    uint16_t wcharSize = 0;
+    NHandyPack::Load(in, fileCheckSum, wcharSize);
+    if (!in || fileCheckSum != checkSum || wcharSize != sizeof(wchar_t)) {
+        return false;
+    }
+
+    TFlatArray<uint32_t> states;
+    TFlatArray<TEdge> edges;
+    TFlatArray<TWordId> ids;
+    TFlatArray<TWordId> ranks;
+    if (!file->Get(DAWG_SECTION_STATES, states) ||
+        !file->Get(DAWG_SECTION_EDGES, edges) ||
+        !file->Get(DAWG_SECTION_IDS, ids) ||
+        !file->Get(DAWG_SECTION_RANKS, ranks) ||
+        states.size() < 2 ||
+        (states[states.size() - 1] >> 1) != edges.size())
+    {
+        return false;
+    }
+
+    States.View(states.data(), states.size());
+    Edges.View(edges.data(), edges.size());
+    Ids.View(ids.data(), ids.size());
+    Ranks.View(ranks.data(), ranks.size());
+    File = std::move(file);
+    return true;
+}
+
+} // NJamSpell
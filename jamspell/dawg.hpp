@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <memory>
+
+#include "lang_model.hpp"
+#include "mapped_file.hpp"
+
+namespace NJamSpell {
+
+// Vocabulary compiled into a minimal acyclic automaton (DAWG). Equal word
+// suffixes share states, so it is a compact alternative to the vocabulary
+// pool and index. Every edge keeps the number of words that go before it in
+// lexicographic order, which maps words to ranks and back; ranks are
+// translated to model word ids with a separate array.
+//
+// Candidates are found by walking the automaton with rows of the edit
+// distance matrix (an implicit Levenshtein automaton): branches are cut as
+// soon as no word below can be within the distance, so the cost depends on
+// the number of dictionary neighbours rather than on alphabet size.
+class TDawg {
+public:
+    void Build(const TLangModel& model);
+    TWordId Find(const wchar_t* word, size_t len) const; // UNKNOWN_WORD_ID if missing
+    std::wstring GetWord(TWordId wid) const;
+    TWordId Size() const;
+
+    // Appends ids of words within maxDistance insertions, deletions,
+    // substitutions and transpositions of adjacent letters
+    void FindCandidates(const wchar_t* word, size_t len, size_t maxDistance, TWordIds& result) const;
+    size_t MemoryUsage() const;
+
+    bool Dump(const std::string& fileName, uint64_t checkSum) const;
+    bool Load(const std::string& fileName, uint64_t checkSum);
+
+    struct TEdge {
+        uint32_t Label;
+        uint32_t Target;
+        uint32_t Rank; // words of the state that go before this edge
+    };
+private:
+    uint32_t FindEdge(uint32_t state, wchar_t label) const;
+    uint32_t EdgesBegin(uint32_t state) const;
+    uint32_t EdgesEnd(uint32_t state) const;
+    bool IsFinal(uint32_t state) const;
+private:
+    TFlatArray<uint32_t> States; // first edge << 1 | final, States.size() - 1 states, root is 0
+    TFlatArray<TEdge> Edges;     // sorted by label within a state
+    TFlatArray<TWordId> Ids;     // rank -> word id
+    TFlatArray<TWordId> Ranks;   // word id -> rank
+    std::unique_ptr<TMappedSections> File;
+};
+
+} // NJamSpell
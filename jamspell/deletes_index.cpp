@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <sstream>
+
+#include <contrib/cityhash/city.h>
+#include <contrib/handypack/handypack.hpp>
+
+#include "deletes_index.hpp"
+
+namespace NJamSpell {
+
+constexpr uint64_t DELETES_INDEX_MAGIC_BYTE = 7219804335811273301L;
+constexpr uint16_t DELETES_INDEX_VERSION = 2;
+
+constexpr uint32_t DELETES_INDEX_SECTION_META = 1;
+constexpr uint32_t DELETES_INDEX_SECTION_DIRECTORY = 2;
+constexpr uint32_t DELETES_INDEX_SECTION_KEYS = 3;
+constexpr uint32_t DELETES_INDEX_SECTION_OFFSETS = 4;
+constexpr uint32_t DELETES_INDEX_SECTION_POSTINGS = 5;
+
+constexpr uint32_t DELETES_INDEX_KEYS_PER_BUCKET = 4;
+
+uint64_t TDeletesIndex::Hash(const char* word, size_t len) {
+    return CityHash64(word, len);
+}
+
+static uint32_t DirectoryBucket(uint64_t hash, uint32_t bits) {
+    return bits == 0 ? 0 : uint32_t(hash >> (64 - bits));
+}
+
+void TDeletesIndex::Build(const TLangModel& model) {
+    struct TPosting {
+        uint64_t Key; // bucket in high 32 bits, low hash bits in low 32 bits
+        TWordId Id;
+        bool operator<(const TPosting& other) const {
+            return Key < other.Key || (Key == other.Key && Id < other.Id);
+        }
+        bool operator==(const TPosting& other) const {
+            return Key == other.Key && Id == other.Id;
+        }
+    };
+
+    std::vector<TPosting> postings;
+    std::string coded;
+    TWordId wordsNumber = model.GetWordsNumber();
+    for (TWordId wid = 0; wid < wordsNumber; ++wid) {
+        TWord word = model.GetWordById(wid);
+        model.GetCodec().Encode(word.Ptr, word.Len, coded);
+        postings.push_back({Hash(coded.data(), coded.size()), wid});
+        ForEachDelete2(coded.data(), coded.size(), [&](const char* ptr, size_t len, int) {
+            postings.push_back({Hash(ptr, len), wid});
+        });
+    }
+
+    // Estimate distinct variants to size the directory; the exact number is
+    // only known after sorting, which depends on the directory bits.
+    size_t keysEstimate = std::max<size_t>(postings.size() / 2, 1);
+    uint32_t bits = 0;
+    while (bits < 32 && (uint64_t(1) << bits) * DELETES_INDEX_KEYS_PER_BUCKET < keysEstimate) {
+        ++bits;
+    }
+    for (auto&& p: postings) {
+        p.Key = (uint64_t(DirectoryBucket(p.Key, bits)) << 32) | uint32_t(p.Key);
+    }
+    std::sort(postings.begin(), postings.end());
+    postings.erase(std::unique(postings.begin(), postings.end()), postings.end());
+
+    std::vector<uint32_t> directory((size_t(1) << bits) + 1, 0);
+    std::vector<uint32_t> keys;
+    std::vector<uint32_t> offsets;
+    std::vector<TWordId> ids;
+    ids.reserve(postings.size());
+    for (size_t i = 0; i < postings.size(); ++i) {
+        if (i == 0 || postings[i].Key != postings[i - 1].Key) {
+            keys.push_back(uint32_t(postings[i].Key));
+            offsets.push_back(ids.size());
+            directory[(postings[i].Key >> 32) + 1] += 1;
+        }
+        ids.push_back(postings[i].Id);
+    }
+    offsets.push_back(ids.size());
+    assert(ids.size() <= std::numeric_limits<uint32_t>::max());
+    for (size_t i = 1; i < directory.size(); ++i) {
+        directory[i] += directory[i - 1];
+    }
+
+    File.reset();
+    Codec = &model.GetCodec();
+    DirectoryBits = bits;
+    Directory.Assign(std::move(directory));
+    Keys.Assign(std::move(keys));
+    Offsets.Assign(std::move(offsets));
+    Postings.Assign(std::move(ids));
+}
+
+void TDeletesIndex::FindVariant(const char* word, size_t len, TWordIds& result) const {
+    uint64_t hash = Hash(word, len);
+    uint32_t bucket = DirectoryBucket(hash, DirectoryBits);
+    const uint32_t* begin = Keys.begin() + Directory[bucket];
+    const uint32_t* end = Keys.begin() + Directory[bucket + 1];
+    const uint32_t* it = std::lower_bound(begin, end, uint32_t(hash));
+    if (it == end || *it != uint32_t(hash)) {
+        return;
+    }
+    size_t key = it - Keys.begin();
+    result.insert(result.end(), Postings.begin() + Offsets[key], Postings.begin() + Offsets[key + 1]);
+}
+
+// Appends ids of words that are within two deletes from a common variant;
+// the same id may be added several times.
+void TDeletesIndex::Find(const wchar_t* word, size_t len, TWordIds& result) const {
+    if (Directory.empty()) {
+        return;
+    }
+    std::string coded;
+    Codec->Encode(word, len, coded);
+    ForEachDelete2(coded.data(), coded.size(), [&](const char* ptr, size_t len, int) {
+        FindVariant(ptr, len, result);
+    });
+    FindVariant(coded.data(), coded.size(), result);
+}
+
+size_t TDeletesIndex::MemoryUsage() const {
+    return Directory.size() * sizeof(uint32_t) +
+           Keys.size() * sizeof(uint32_t) +
+           Offsets.size() * sizeof(uint32_t) +
+           Postings.size() * sizeof(TWordId);
+}
+
+bool TDeletesIndex::Dump(const std::string& fileName, uint64_t checkSum) const {
+    if (Directory.empty()) {
+        return false;
+    }
+    std::stringbuf metaBuf;
+    std::ostream meta(&metaBuf);
+    NHandyPack::Dump(meta, checkSum, DirectoryBits);
+
+    TSectionsWriter writer;
+    writer.Add(DELETES_INDEX_SECTION_META, metaBuf.str());
+    writer.Add(DELETES_INDEX_SECTION_DIRECTORY, Directory);
+    writer.Add(DELETES_INDEX_SECTION_KEYS, Keys);
+    writer.Add(DELETES_INDEX_SECTION_OFFSETS, Offsets);
+    writer.Add(DELETES_INDEX_SECTION_POSTINGS, Postings);
+    return writer.Write(fileName, DELETES_INDEX_MAGIC_BYTE, DELETES_INDEX_VERSION);
+}
+
+bool TDeletesIndex::Load(const std::string& fileName, const TLangModel& model) {
+    std::unique_ptr<TMappedSections> file(new TMappedSections());
+    if (!file->Open(fileName, DELETES_INDEX_MAGIC_BYTE, DELETES_INDEX_VERSION)) {
+        return false;
+    }
+    const char* meta = nullptr;
+    size_t metaSize = 0;
+    if (!file->Get(DELETES_INDEX_SECTION_META, meta, metaSize)) {
+        return false;
+    }
+    NHandyPack::imemstream in(meta, metaSize);
+    uint64_t checkSum = 0;
+    uint32_t bits = 0;
+    NHandyPack::Load(in, checkSum, bits);
+    if (!in || checkSum != model.GetCheckSum() || bits > 32) {
+        return false;
+    }
+
+    TFlatArray<uint32_t> directory;
+    TFlatArray<uint32_t> keys;
+    TFlatArray<uint32_t> offsets;
+    TFlatArray<TWordId> postings;
+    if (!file->Get(DELETES_INDEX_SECTION_DIRECTORY, directory) ||
+        !file->Get(DELETES_INDEX_SECTION_KEYS, keys) ||
+        !file->Get(DELETES_INDEX_SECTION_OFFSETS, offsets) ||
+        !file->Get(DELETES_INDEX_SECTION_POSTINGS, postings) ||
+        directory.size() != (size_t(1) << bits) + 1 ||
+        directory[directory.size() - 1] != keys.size() ||
+        offsets.size() != keys.size() + 1 ||
+        offsets[offsets.size() - 1] != postings.size())
+    {
+        return false;
+    }
+
+    Codec = &model.GetCodec();
+    DirectoryBits = bits;
+    Directory.View(directory.data(), directory.size());
+    Keys.View(keys.data(), keys.size());
+    Offsets.View(offsets.data(), offsets.size());
+    Postings.View(postings.data(), postings.size());
+    File = std::move(file);
+    return true;
+}
+
+} // NJamSpell
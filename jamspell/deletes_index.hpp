@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "lang_model.hpp"
+#include "mapped_file.hpp"
+
+namespace NJamSpell {
+
+// Calls callback(ptr, len, level) for each non-empty word with one (level 1)
+// or two (level 2) letters deleted: for every first deletion its second
+// deletions go first, then the first deletion itself. Variants are built in
+// scratch buffers and are only valid during the callback.
+template<typename TChar, typename TCallback>
+void ForEachDelete2(const TChar* word, size_t len, TCallback&& callback) {
+    if (len < 2) {
+        return;
+    }
+    std::basic_string<TChar> buffer1(len, 0);
+    std::basic_string<TChar> buffer2(len, 0);
+    TChar* deleted1 = &buffer1[0];
+    TChar* deleted2 = &buffer2[0];
+    for (size_t i = 0; i < len; ++i) {
+        std::copy(word, word + i, deleted1);
+        std::copy(word + i + 1, word + len, deleted1 + i);
+        size_t len1 = len - 1;
+        if (len1 > 1) {
+            for (size_t j = 0; j < len1; ++j) {
+                std::copy(deleted1, deleted1 + j, deleted2);
+                std::copy(deleted1 + j + 1, deleted1 + len1, deleted2 + j);
+                callback(deleted2, len1 - 1, 2);
+            }
+        }
+        callback(deleted1, len1, 1);
+    }
+}
+
+// Symmetric delete index (as in SymSpell): every vocabulary word and each of
+// its one and two letter deletions map to the word id. Words sharing any such
+// variant with a query are found with exact lookups of the query variants,
+// which gives the same candidates as probing bloom filters of deletions and
+// trying all inserts.
+//
+// Variants are identified by 64-bit hashes of their alphabet coded form: the
+// top bits select a directory bucket, the low 32 bits are searched within it.
+// Hash collisions may only add extra candidates.
+class TDeletesIndex {
+public:
+    void Build(const TLangModel& model);
+    void Find(const wchar_t* word, size_t len, TWordIds& result) const;
+    size_t MemoryUsage() const;
+
+    bool Dump(const std::string& fileName, uint64_t checkSum) const;
+    // The model should outlive the index
+    bool Load(const std::string& fileName, const TLangModel& model);
+private:
+    void FindVariant(const char* word, size_t len, TWordIds& result) const;
+    static uint64_t Hash(const char* word, size_t len);
+private:
+    const TAlphabetCodec* Codec = nullptr;
+    uint32_t DirectoryBits = 0;
+    TFlatArray<uint32_t> Directory; // bucket -> first key, 2^DirectoryBits + 1 items
+    TFlatArray<uint32_t> Keys;      // low hash bits, sorted within a bucket
+    TFlatArray<uint32_t> Offsets;   // key -> first posting, Keys.size() + 1 items
+    TFlatArray<TWordId> Postings;
+    std::unique_ptr<TMappedSections> File;
+};
+
+} // NJamSpell
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <vector>
+
+#include "utils.hpp"
+#include "gram_key.hpp"
+#include "gram_table.hpp"
+
+namespace NJamSpell {
+
+// N-gram with its count, as stored in counting tables and in sorted runs
+template<size_t N>
+struct TGramRecord {
+    std::array<TWordId, N> Words;
+    TCount Count;
+    bool operator<(const TGramRecord& other) const {
+        return Words < other.Words;
+    }
+};
+
+inline uint64_t GramHash(const std::array<TWordId, 2>& words) {
+    return TPackedGram<2>(words[0], words[1]).Hash();
+}
+
+inline uint64_t GramHash(const std::array<TWordId, 3>& words) {
+    return TPackedGram<3>(words[0], words[1], words[2]).Hash();
+}
+
+// Training counts of n-grams: an open addressing table of records probed
+// linearly, so an n-gram takes 4 * (N + 1) bytes per slot and there are no
+// per-item allocations. UNKNOWN_WORD_ID is never counted and marks empty slots.
+template<size_t N>
+class TGramCounts {
+public:
+    void Add(const std::array<TWordId, N>& words, TCount count = 1) {
+        assert(words[0] != UNKNOWN_WORD_ID);
+        if (Full()) {
+            Rehash(NextSlotsNumber());
+        }
+        TGramRecord<N>* slot = FindSlot(words);
+        if (slot->Words[0] == UNKNOWN_WORD_ID) {
+            slot->Words = words;
+            slot->Count = 0;
+            ++ItemsNumber;
+        }
+        slot->Count += count;
+    }
+
+    size_t Size() const {
+        return ItemsNumber;
+    }
+
+    size_t MemoryUsage() const {
+        return Slots.size() * sizeof(TGramRecord<N>);
+    }
+
+    // Memory taken while the next Add runs: a rehash holds both tables
+    size_t NextAddMemoryUsage() const {
+        return MemoryUsage() + (Full() ? NextSlotsNumber() * sizeof(TGramRecord<N>) : 0);
+    }
+
+    // Calls func(record) for every n-gram, in no particular order
+    template<typename TFunc>
+    void ForEach(TFunc&& func) const {
+        for (auto&& slot: Slots) {
+            if (slot.Words[0] != UNKNOWN_WORD_ID) {
+                func(slot);
+            }
+        }
+    }
+
+    // Moves all n-grams out, in no particular order; the table is left empty
+    std::vector<TGramRecord<N>> Release() {
+        std::vector<TGramRecord<N>> records;
+        records.swap(Slots);
+        auto end = std::remove_if(records.begin(), records.end(), [](const TGramRecord<N>& r) {
+            return r.Words[0] == UNKNOWN_WORD_ID;
+        });
+        records.erase(end, records.end());
+        ItemsNumber = 0;
+        return records;
+    }
+
+    void Clear() {
+        std::vector<TGramRecord<N>>().swap(Slots);
+        ItemsNumber = 0;
+    }
+private:
+    // Keeps load factor under 3/4
+    bool Full() const {
+        return 4 * (ItemsNumber + 1) > 3 * Slots.size();
+    }
+
+    size_t NextSlotsNumber() const {
+        return std::max(Slots.size() * 2, size_t(16));
+    }
+
+    TGramRecord<N>* FindSlot(const std::array<TWordId, N>& words) {
+        size_t mask = Slots.size() - 1;
+        size_t pos = GramHash(words) & mask;
+        while (Slots[pos].Words[0] != UNKNOWN_WORD_ID && Slots[pos].Words != words) {
+            pos = (pos + 1) & mask;
+        }
+        return &Slots[pos];
+    }
+
+    void Rehash(size_t slotsNumber) {
+        TGramRecord<N> empty;
+        empty.Words.fill(UNKNOWN_WORD_ID);
+        empty.Count = 0;
+        std::vector<TGramRecord<N>> slots(slotsNumber, empty);
+        slots.swap(Slots);
+        for (auto&& slot: slots) {
+            if (slot.Words[0] != UNKNOWN_WORD_ID) {
+                *FindSlot(slot.Words) = slot;
+            }
+        }
+    }
+private:
+    std::vector<TGramRecord<N>> Slots; // power of two sized
+    size_t ItemsNumber = 0;
+};
+
+} // NJamSpell
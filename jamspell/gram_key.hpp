@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "utils.hpp"
+
+namespace NJamSpell {
+
+// Word ids of an n-gram packed into a fixed-width integer (4, 8 or 12 bytes).
+// Hash() is the only hash computed per lookup: the perfect hash bucket is
+// derived from it and its top bits are used as the bucket fingerprint.
+template<size_t N>
+struct TPackedGram;
+
+inline uint64_t MixHash64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+template<>
+struct TPackedGram<1> {
+    explicit TPackedGram(TWordId w1)
+        : Key(w1)
+    {
+    }
+    uint64_t Hash() const {
+        return MixHash64(uint64_t(Key) ^ 0x9e3779b97f4a7c15ULL);
+    }
+    uint32_t Key;
+};
+
+template<>
+struct TPackedGram<2> {
+    TPackedGram(TWordId w1, TWordId w2)
+        : Key((uint64_t(w1) << 32) | w2)
+    {
+    }
+    uint64_t Hash() const {
+        return MixHash64(Key ^ 0xc2b2ae3d27d4eb4fULL);
+    }
+    uint64_t Key;
+};
+
+template<>
+struct TPackedGram<3> {
+    TPackedGram(TWordId w1, TWordId w2, TWordId w3)
+        : Key12((uint64_t(w1) << 32) | w2)
+        , Key3(w3)
+    {
+    }
+    uint64_t Hash() const {
+        return MixHash64(MixHash64(Key12 ^ 0x165667b19e3779f9ULL) ^ Key3);
+    }
+    uint64_t Key12;
+    uint32_t Key3;
+};
+
+// N-gram of order 1-3 chosen at runtime, for batched lookups
+struct TGramKey {
+    explicit TGramKey(TWordId w1)
+        : Words{w1, 0, 0}
+        , Order(1)
+    {
+    }
+    TGramKey(TWordId w1, TWordId w2)
+        : Words{w1, w2, 0}
+        , Order(2)
+    {
+    }
+    TGramKey(TWordId w1, TWordId w2, TWordId w3)
+        : Words{w1, w2, w3}
+        , Order(3)
+    {
+    }
+    bool Contains(TWordId wid) const {
+        for (uint32_t i = 0; i < Order; ++i) {
+            if (Words[i] == wid) {
+                return true;
+            }
+        }
+        return false;
+    }
+    uint64_t Hash() const {
+        switch (Order) {
+        case 1:
+            return TPackedGram<1>(Words[0]).Hash();
+        case 2:
+            return TPackedGram<2>(Words[0], Words[1]).Hash();
+        default:
+            return TPackedGram<3>(Words[0], Words[1], Words[2]).Hash();
+        }
+    }
+    TWordId Words[3];
+    uint32_t Order;
+};
+
+} // NJamSpell
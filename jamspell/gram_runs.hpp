@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "gram_counts.hpp"
+
+namespace NJamSpell {
+
+// Temporary run files, removed with the object
+struct TGramRuns {
+    TGramRuns() = default;
+    TGramRuns(const TGramRuns&) = delete;
+    TGramRuns& operator=(const TGramRuns&) = delete;
+    ~TGramRuns() {
+        for (auto&& file: Files) {
+            std::remove(file.c_str());
+        }
+    }
+    std::vector<std::string> Files;
+};
+
+// Sorts records and writes them to a new run file
+template<size_t N>
+bool WriteGramRun(std::vector<TGramRecord<N>>& records, const std::string& fileName, TGramRuns& runs) {
+    std::sort(records.begin(), records.end());
+    runs.Files.push_back(fileName);
+    std::ofstream out(fileName, std::ios::binary);
+    out.write((const char*)records.data(), records.size() * sizeof(TGramRecord<N>));
+    return bool(out);
+}
+
+template<size_t N>
+class TGramRunReader {
+public:
+    bool Open(const std::string& fileName) {
+        In.open(fileName, std::ios::binary);
+        return bool(In);
+    }
+    bool Next() {
+        if (++Pos < Size) {
+            return true;
+        }
+        In.read((char*)Buffer.data(), Buffer.size() * sizeof(TGramRecord<N>));
+        Size = In.gcount() / sizeof(TGramRecord<N>);
+        Pos = 0;
+        return Size > 0;
+    }
+    bool Failed() const {
+        return In.bad();
+    }
+    const TGramRecord<N>& Get() const {
+        return Buffer[Pos];
+    }
+private:
+    std::ifstream In;
+    std::vector<TGramRecord<N>> Buffer = std::vector<TGramRecord<N>>(4096);
+    size_t Size = 0;
+    size_t Pos = 0;
+};
+
+// Runs merged at once: each of them takes an open file and a read buffer
+constexpr size_t GRAM_RUNS_MERGE_WAYS = 64;
+
+// Merges sorted run files, calling callback(words, count) once per distinct
+// n-gram in order, with counts of all runs summed up.
+template<size_t N, typename TCallback>
+bool MergeGramRuns(const std::vector<std::string>& files, TCallback&& callback) {
+    std::vector<std::unique_ptr<TGramRunReader<N>>> readers;
+    auto greater = [&](size_t a, size_t b) {
+        return readers[b]->Get() < readers[a]->Get();
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heads(greater);
+    for (auto&& file: files) {
+        readers.emplace_back(new TGramRunReader<N>());
+        if (!readers.back()->Open(file)) {
+            return false;
+        }
+        if (readers.back()->Next()) {
+            heads.push(readers.size() - 1);
+        }
+    }
+    while (!heads.empty()) {
+        size_t run = heads.top();
+        heads.pop();
+        TGramRecord<N> record = readers[run]->Get();
+        if (readers[run]->Next()) {
+            heads.push(run);
+        }
+        while (!heads.empty() && readers[heads.top()]->Get().Words == record.Words) {
+            size_t same = heads.top();
+            heads.pop();
+            record.Count += readers[same]->Get().Count;
+            if (readers[same]->Next()) {
+                heads.push(same);
+            }
+        }
+        callback(record.Words, record.Count);
+    }
+    for (auto&& reader: readers) {
+        if (reader->Failed()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Merges run files into a new run, sets gramsNumber to its size
+template<size_t N>
+bool WriteMergedRun(const std::vector<std::string>& files, const std::string& fileName,
+                    TGramRuns& runs, size_t& gramsNumber)
+{
+    runs.Files.push_back(fileName);
+    std::ofstream out(fileName, std::ios::binary);
+    gramsNumber = 0;
+    bool read = MergeGramRuns<N>(files, [&](const std::array<TWordId, N>& words, TCount count) {
+        TGramRecord<N> record = {words, count};
+        out.write((const char*)&record, sizeof(record));
+        ++gramsNumber;
+    });
+    out.close();
+    return read && bool(out);
+}
+
+// Merges runs into a single one with passes of up to ways runs at once.
+// Files of a pass are named prefix + pass + "_" + group.
+template<size_t N>
+bool MergeGramRunsToOne(TGramRuns& runs, const std::string& prefix, size_t ways, size_t& gramsNumber) {
+    assert(ways >= 2);
+    gramsNumber = 0;
+    for (size_t pass = 0; pass == 0 || runs.Files.size() > 1; ++pass) {
+        TGramRuns merged;
+        for (size_t begin = 0; begin < runs.Files.size() || begin == 0; begin += ways) {
+            size_t end = std::min(begin + ways, runs.Files.size());
+            std::vector<std::string> files(runs.Files.begin() + begin, runs.Files.begin() + end);
+            std::string fileName = prefix + std::to_string(pass) + "_" + std::to_string(begin / ways) + ".tmp";
+            if (!WriteMergedRun<N>(files, fileName, merged, gramsNumber)) {
+                return false;
+            }
+        }
+        std::swap(runs.Files, merged.Files); // merged removes the inputs
+    }
+    return true;
+}
+
+} // NJamSpell
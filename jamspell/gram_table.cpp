@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+
+#include <contrib/handypack/handypack.hpp>
+
+#include "gram_table.hpp"
+
+namespace NJamSpell {
+
+// Without enough fingerprint bits missing n-grams read counts of others
+constexpr uint32_t MIN_FINGERPRINT_BITS = 8;
+constexpr uint32_t MAX_FINGERPRINT_BITS = 24;
+// With fewer count bits low counts are quantized to 0, as if missing
+constexpr uint32_t MIN_COUNT_BITS = 6;
+constexpr uint32_t MAX_COUNT_BITS = 16; // packed counts are decoded with a table
+constexpr uint32_t MAX_BUCKET_BITS = 56; // a bucket is read with one unaligned 64-bit load
+
+bool TBucketLayout::IsValid() const {
+    return FingerprintBits >= MIN_FINGERPRINT_BITS && FingerprintBits <= MAX_FINGERPRINT_BITS &&
+           CountBits >= MIN_COUNT_BITS && CountBits <= MAX_COUNT_BITS &&
+           Bits() <= MAX_BUCKET_BITS;
+}
+
+uint32_t TBucketLayout::Bits() const {
+    return FingerprintBits + CountBits;
+}
+
+static bool ParseBucketLayout(const std::string& str, TBucketLayout& layout) {
+    std::istringstream in(str);
+    char separator = 0;
+    if (!(in >> layout.FingerprintBits >> separator >> layout.CountBits) || separator != ':' || !in.eof()) {
+        return false;
+    }
+    return layout.IsValid();
+}
+
+bool ParseBucketLayouts(const std::string& str, TBucketLayouts& layouts) {
+    std::vector<std::string> parts;
+    std::istringstream in(str);
+    for (std::string part; std::getline(in, part, ',');) {
+        parts.push_back(part);
+    }
+    if (parts.size() == 1) {
+        std::string layout = parts[0];
+        parts.resize(layouts.size(), layout);
+    }
+    if (parts.size() != layouts.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < parts.size(); ++i) {
+        if (!ParseBucketLayout(parts[i], layouts[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint64_t LowBitsMask(uint32_t bits) {
+    return bits >= 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1;
+}
+
+bool TGramTable::Init(const std::vector<uint64_t>& hashes, TCount maxCount, const TBucketLayout& layout) {
+    assert(layout.IsValid());
+    Clear();
+    bool res;
+    if (hashes.empty()) {
+        res = PerfectHash.Init(std::vector<uint64_t>(1, 0)); // lookups just miss
+    } else {
+        res = PerfectHash.Init(hashes);
+    }
+    if (!res) {
+        return false;
+    }
+    Layout = layout;
+    MaxCount = maxCount;
+    PrepareCounts();
+    uint64_t bits = uint64_t(PerfectHash.BucketsNumber()) * Layout.Bits();
+    Buckets.Assign(std::vector<uint64_t>((bits + 63) / 64 + 1, 0));
+    return true;
+}
+
+void TGramTable::Set(uint64_t hash, TCount count) {
+    uint32_t bucket = PerfectHash.Hash(hash);
+    assert(bucket < BucketsNumber());
+    uint64_t value = (uint64_t(Fingerprint(hash)) << Layout.CountBits) | PackCount(count);
+    uint64_t bitPos = uint64_t(bucket) * Layout.Bits();
+    char* ptr = (char*)Buckets.MutableData() + bitPos / 8;
+    uint32_t shift = bitPos % 8;
+    uint64_t mask = LowBitsMask(Layout.Bits()) << shift;
+    uint64_t data;
+    memcpy(&data, ptr, sizeof(data));
+    uint64_t prevCount = (data >> shift) & LowBitsMask(Layout.CountBits);
+    if (prevCount > (value & LowBitsMask(Layout.CountBits))) {
+        return;
+    }
+    data = (data & ~mask) | (value << shift);
+    memcpy(ptr, &data, sizeof(data));
+}
+
+uint64_t TGramTable::ReadBucket(uint32_t bucket) const {
+    uint64_t bitPos = uint64_t(bucket) * Layout.Bits();
+    uint64_t data;
+    memcpy(&data, (const char*)Buckets.data() + bitPos / 8, sizeof(data));
+    return (data >> (bitPos % 8)) & LowBitsMask(Layout.Bits());
+}
+
+uint32_t TGramTable::GetPacked(uint64_t hash, uint32_t bucket) const {
+    assert(bucket < BucketsNumber());
+    uint64_t data = ReadBucket(bucket);
+    if ((data >> Layout.CountBits) != Fingerprint(hash)) {
+        return 0;
+    }
+    return uint32_t(data & LowBitsMask(Layout.CountBits));
+}
+
+TCount TGramTable::Get(uint64_t hash, uint32_t bucket) const {
+    return Unpack(GetPacked(hash, bucket));
+}
+
+TCount TGramTable::Get(uint64_t hash) const {
+    return Get(hash, PerfectHash.Hash(hash));
+}
+
+uint32_t TGramTable::Fingerprint(uint64_t hash) const {
+    if (Layout.FingerprintBits == 0) {
+        return 0;
+    }
+    return uint32_t(hash >> (64 - Layout.FingerprintBits));
+}
+
+// Counts are stored as (count / MaxCount) ^ 0.2, which keeps small counts
+// (the majority) nearly exact and rounds large ones.
+uint32_t TGramTable::PackCount(TCount count) const {
+    if (count == 0 || MaxCount == 0) {
+        return 0;
+    }
+    double r = double(count) / double(MaxCount);
+    assert(r >= 0.0 && r <= 1.0);
+    r = pow(r, 0.2);
+    r *= double(uint64_t(1) << Layout.CountBits);
+    return uint32_t(std::min<uint64_t>(uint64_t(r), LowBitsMask(Layout.CountBits)));
+}
+
+void TGramTable::PrepareCounts() {
+    std::vector<TCount> counts(PackedCountsNumber());
+    for (uint32_t packed = 0; packed < counts.size(); ++packed) {
+        double r = double(packed) / double(counts.size());
+        r = pow(r, 5.0);
+        r *= MaxCount;
+        counts[packed] = TCount(ceil(r));
+    }
+    Counts.swap(counts);
+}
+
+uint32_t TGramTable::PackedCountsNumber() const {
+    return uint32_t(1) << Layout.CountBits;
+}
+
+const TBucketLayout& TGramTable::GetLayout() const {
+    return Layout;
+}
+
+uint32_t TGramTable::BucketsNumber() const {
+    return PerfectHash.BucketsNumber();
+}
+
+size_t TGramTable::MemoryUsage() const {
+    if (Buckets.empty()) {
+        return 0;
+    }
+    return Buckets.size() * sizeof(uint64_t) + PerfectHash.DisplacementsSize();
+}
+
+void TGramTable::Clear() {
+    Layout = TBucketLayout();
+    MaxCount = 0;
+    Counts.clear();
+    PerfectHash.Clear();
+    Buckets.Clear();
+}
+
+void TGramTable::DumpParams(std::ostream& out) const {
+    NHandyPack::Dump(out, Layout.FingerprintBits, Layout.CountBits, MaxCount);
+    PerfectHash.DumpParams(out);
+}
+
+void TGramTable::LoadParams(std::istream& in) {
+    Clear();
+    NHandyPack::Load(in, Layout.FingerprintBits, Layout.CountBits, MaxCount);
+    PerfectHash.LoadParams(in);
+    if (Layout.IsValid()) {
+        PrepareCounts();
+    }
+}
+
+void TGramTable::Dump(TSectionsWriter& writer, uint32_t bucketsSection, uint32_t displacementsSection) const {
+    writer.Add(bucketsSection, Buckets);
+    writer.Add(displacementsSection, PerfectHash.DisplacementsData(), PerfectHash.DisplacementsSize());
+}
+
+// LoadParams should be called first
+bool TGramTable::Load(const TMappedSections& file, uint32_t bucketsSection, uint32_t displacementsSection) {
+    if (!Layout.IsValid()) {
+        return false;
+    }
+    const char* displacements = nullptr;
+    size_t displacementsSize = 0;
+    if (!file.Get(displacementsSection, displacements, displacementsSize) ||
+        displacementsSize != PerfectHash.DisplacementsSize())
+    {
+        return false;
+    }
+    PerfectHash.SetDisplacements(displacements);
+
+    uint64_t bits = uint64_t(PerfectHash.BucketsNumber()) * Layout.Bits();
+    if (!file.Get(bucketsSection, Buckets) || Buckets.size() != (bits + 63) / 64 + 1) {
+        return false;
+    }
+    return true;
+}
+
+} // NJamSpell
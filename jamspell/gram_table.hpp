@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <string>
+#include <istream>
+#include <ostream>
+
+#include "utils.hpp"
+#include "perfect_hash.hpp"
+#include "mapped_file.hpp"
+
+namespace NJamSpell {
+
+using TCount = uint32_t;
+
+// Bits of a single bucket: a fingerprint taken from the top bits of the
+// n-gram hash and a count quantized on a power scale up to the table maximum.
+struct TBucketLayout {
+    uint32_t FingerprintBits = 16;
+    uint32_t CountBits = 16;
+
+    bool IsValid() const;
+    uint32_t Bits() const;
+};
+
+using TBucketLayouts = std::array<TBucketLayout, 2>; // for orders 2, 3
+
+// Parses "F:C" (all orders) or "F2:C2,F3:C3"
+bool ParseBucketLayouts(const std::string& str, TBucketLayouts& layouts);
+
+// Counts of n-grams of a single order: a perfect hash over 64-bit n-gram
+// hashes and a bit-packed bucket array. Lookups are split into stages so
+// that callers can prefetch displacements and buckets of many keys at once.
+class TGramTable {
+public:
+    // hashes must be unique; Set() should be called for each of them then
+    bool Init(const std::vector<uint64_t>& hashes, TCount maxCount, const TBucketLayout& layout);
+    // Keeps the largest count set for a hash, so the order of calls doesn't matter
+    void Set(uint64_t hash, TCount count);
+
+    uint32_t DisplacementSlot(uint64_t hash) const {
+        return PerfectHash.DisplacementSlot(hash);
+    }
+    void PrefetchDisplacement(uint32_t slot) const {
+        PerfectHash.PrefetchDisplacement(slot);
+    }
+    uint32_t Bucket(uint64_t hash, uint32_t slot) const {
+        return PerfectHash.Hash(hash, slot);
+    }
+    void PrefetchBucket(uint32_t bucket) const {
+        Prefetch((const char*)Buckets.data() + (uint64_t(bucket) * Layout.Bits()) / 8);
+    }
+    TCount Get(uint64_t hash, uint32_t bucket) const;
+    TCount Get(uint64_t hash) const;
+
+    // Counts are stored packed in CountBits, 0 for missing n-grams
+    uint32_t GetPacked(uint64_t hash, uint32_t bucket) const;
+    TCount Unpack(uint32_t packed) const {
+        return Counts[packed];
+    }
+    uint32_t PackedCountsNumber() const;
+
+    const TBucketLayout& GetLayout() const;
+    uint32_t BucketsNumber() const;
+    size_t MemoryUsage() const;
+    void Clear();
+
+    void DumpParams(std::ostream& out) const;
+    void LoadParams(std::istream& in);
+    void Dump(TSectionsWriter& writer, uint32_t bucketsSection, uint32_t displacementsSection) const;
+    bool Load(const TMappedSections& file, uint32_t bucketsSection, uint32_t displacementsSection);
+private:
+    uint64_t ReadBucket(uint32_t bucket) const;
+    uint32_t Fingerprint(uint64_t hash) const;
+    uint32_t PackCount(TCount count) const;
+    void PrepareCounts();
+private:
+    TBucketLayout Layout;
+    TCount MaxCount = 0;
+    std::vector<TCount> Counts; // packed count -> count
+    TPerfectHash PerfectHash;
+    TFlatArray<uint64_t> Buckets; // one spare word at the end for unaligned reads
+};
+
+} // NJamSpell
@@ -7,6 +7,7 @@
 #include <cstring>
 #include <algorithm>
 #include "lang_model.hpp"
+#include "gram_runs.hpp"
 
 #include <contrib/cityhash/city.h>
 
@@ -16,204 +17,633 @@
 
 namespace NJamSpell {
 
-class MemStream: public std::basic_streambuf<char> {
-public:
-    MemStream(char* buff, long maxSize)
-        : Buff(buff)
-        , MaxSize(maxSize)
-        , Pos(0)
-    {
+// Run files open at once when shards are merged, well below the usual
+// limit of 1024 descriptors per process
+constexpr size_t TRAIN_MAX_OPEN_RUNS = 256;
+
+// Counts are sharded by n-gram over counting threads
+template<size_t N>
+size_t GramsNumber(const std::vector<TGramCounts<N>>& shards) {
+    size_t result = 0;
+    for (auto&& shard: shards) {
+        result += shard.Size();
+    }
+    return result;
+}
+
+// A cheap mix of word ids: shards only need to be filled evenly,
+// the tables hash n-grams on their own
+template<size_t N>
+size_t GramShard(const std::array<TWordId, N>& words, size_t shardsNumber) {
+    uint64_t hash = 0;
+    for (auto w: words) {
+        hash = (hash + w) * 0x9E3779B97F4A7C15ULL;
     }
+    return (hash >> 32) % shardsNumber;
+}
 
-	std::streamsize xsputn(const char* s, std::streamsize n) override {
-        if (n <= 0) {
-            return n;
+// Moves counts of a shard into a sorted run file
+template<size_t N>
+bool SpillGrams(TGramCounts<N>& grams, const std::string& fileName, TGramRuns& runs) {
+    std::vector<TGramRecord<N>> records = grams.Release();
+    return WriteGramRun(records, fileName, runs);
+}
+
+// Calls func(record) for n-grams of a shard, kept in memory or in a single run
+template<size_t N, typename TFunc>
+bool ForEachShardGram(const std::vector<TGramRecord<N>>& records, const TGramRuns* runs, TFunc&& func) {
+    if (!runs) {
+        for (auto&& record: records) {
+            func(record);
         }
-        long toCopy = std::min<long>(n, MaxSize - Pos);
-        memcpy(Buff + Pos, s, toCopy);
-        Pos += toCopy;
-        return n;
+        return true;
     }
-    void Reset() {
-        Pos = 0;
+    TGramRunReader<N> reader;
+    if (!reader.Open(runs->Files[0])) {
+        return false;
     }
-    long Size() const {
-        return Pos;
+    while (reader.Next()) {
+        func(reader.Get());
     }
-private:
-    char* Buff;
-    long MaxSize;
-    long Pos;
-};
-
-template<typename T>
-std::string DumpKey(const T& key) {
-    std::stringbuf buf;
-    std::ostream out(&buf);
-    NHandyPack::Dump(out, key);
-    return buf.str();
+    return !reader.Failed();
 }
 
-template<typename T>
-void PrepareNgramKeys(const T& grams, std::vector<std::string>& keys) {
-    for (auto&& it: grams) {
-        keys.push_back(DumpKey(it.first));
+// Moves counts out of counters one by one, without their empty slots
+template<size_t N>
+std::vector<std::vector<TGramRecord<N>>> ReleaseCounts(std::vector<TGramCounts<N>>& shards) {
+    std::vector<std::vector<TGramRecord<N>>> records(shards.size());
+    for (size_t shard = 0; shard < shards.size(); ++shard) {
+        records[shard] = shards[shard].Release();
+        records[shard].shrink_to_fit();
     }
+    return records;
 }
 
-static const uint32_t MAX_REAL_NUM = 268435456;
-static const uint32_t MAX_AVAILABLE_NUM = 65536;
+// Builds the table right from the counted records or runs: n-gram hashes
+// are the only per-key copy made for the perfect hash, counts are set from
+// the source after it's built. Sets gramsNumber to the number of distinct n-grams.
+template<size_t N>
+bool InitializeGrams(std::vector<std::vector<TGramRecord<N>>>& records, std::vector<TGramRuns>& runs,
+                     const std::string& runsPrefix, TCount maxCount, const TBucketLayout& layout,
+                     TGramTable& table, size_t& gramsNumber)
+{
+    size_t shardsNumber = records.size();
+    std::vector<size_t> sizes(shardsNumber);
+    std::vector<char> succeeded(shardsNumber, 1);
+    auto allSucceeded = [&]() {
+        return std::find(succeeded.begin(), succeeded.end(), 0) == succeeded.end();
+    };
+    if (runs.empty()) {
+        for (size_t shard = 0; shard < shardsNumber; ++shard) {
+            sizes[shard] = records[shard].size();
+        }
+    } else {
+        // Shards are merged in parallel, so they share the open files limit
+        size_t ways = std::max<size_t>(2, std::min(GRAM_RUNS_MERGE_WAYS, TRAIN_MAX_OPEN_RUNS / shardsNumber));
+        RunParts(shardsNumber, [&](size_t shard) {
+            std::string prefix = runsPrefix + std::to_string(shard) + "_" + std::to_string(N) + "_";
+            succeeded[shard] = MergeGramRunsToOne<N>(runs[shard], prefix, ways, sizes[shard]);
+        });
+        if (!allSucceeded()) {
+            return false;
+        }
+    }
+    auto shardRuns = [&](size_t shard) {
+        return runs.empty() ? nullptr : &runs[shard];
+    };
+
+    std::vector<size_t> offsets(shardsNumber + 1, 0);
+    for (size_t shard = 0; shard < shardsNumber; ++shard) {
+        offsets[shard + 1] = offsets[shard] + sizes[shard];
+    }
+    gramsNumber = offsets.back();
+    std::vector<uint64_t> keys(gramsNumber);
+    RunParts(shardsNumber, [&](size_t shard) {
+        uint64_t* key = keys.data() + offsets[shard];
+        succeeded[shard] = ForEachShardGram(records[shard], shardRuns(shard), [&](const TGramRecord<N>& record) {
+            *key++ = GramHash(record.Words);
+        });
+    });
+    if (!allSucceeded()) {
+        return false;
+    }
 
-uint16_t PackInt32(uint32_t num) {
-    double r = double(num) / double(MAX_REAL_NUM);
-    assert(r >= 0.0 && r <= 1.0);
-    r = pow(r, 0.2);
-    r *= MAX_AVAILABLE_NUM;
-    return uint16_t(r);
+    // Distinct n-grams with equal 64-bit hashes share a bucket, just
+    // like fingerprint collisions do, with the largest count.
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    if (!table.Init(keys, maxCount, layout)) {
+        return false;
+    }
+    std::vector<uint64_t>().swap(keys);
+
+    // Buckets are bit-packed, so they are filled by one thread
+    for (size_t shard = 0; shard < shardsNumber; ++shard) {
+        bool read = ForEachShardGram(records[shard], shardRuns(shard), [&](const TGramRecord<N>& record) {
+            table.Set(GramHash(record.Words), record.Count);
+        });
+        if (!read) {
+            return false;
+        }
+        std::vector<TGramRecord<N>>().swap(records[shard]);
+    }
+    return true;
 }
 
-uint32_t UnpackInt32(uint16_t num) {
-    double r = double(num) / double(MAX_AVAILABLE_NUM);
-    r = pow(r, 5.0);
-    r *= MAX_REAL_NUM;
-    return uint32_t(ceil(r));
+constexpr size_t TRAIN_CHUNK_SIZE = 4 * 1024 * 1024; // per thread
+// With a memory limit chunks are made smaller, so that text staging takes
+// at most a quarter of it, but not smaller than that
+constexpr size_t TRAIN_MIN_CHUNK_SIZE = 64 * 1024;
+// Peak memory per byte of a batch while it's tokenized and sharded: read
+// buffers, wide text, words, ids and n-grams; measured on English text
+constexpr uint64_t TRAIN_STAGING_FACTOR = 20;
+
+// End of the longest prefix that tokenizes the same alone as within the whole
+// text: right after a sentence terminator. A sentence longer than the buffer
+// is cut after any ASCII byte that is not a letter, or at a character start.
+static size_t FindChunkEnd(const std::string& buffer, const std::unordered_set<wchar_t>& alphabet) {
+    auto isTerminator = [&](unsigned char c) {
+        return (c == '.' || c == '!' || c == '?') && alphabet.find(wchar_t(c)) == alphabet.end();
+    };
+    auto isSeparator = [&](unsigned char c) {
+        return c < 0x80 && alphabet.find(std::tolower(wchar_t(c), std::locale::classic())) == alphabet.end();
+    };
+    for (size_t i = buffer.size(); i > 0; --i) {
+        if (isTerminator(buffer[i - 1])) {
+            return i;
+        }
+    }
+    for (size_t i = buffer.size(); i > 0; --i) {
+        if (isSeparator(buffer[i - 1])) {
+            return i;
+        }
+    }
+    for (size_t i = buffer.size(); i > 0; --i) {
+        if ((buffer[i - 1] & 0xC0) != 0x80) {
+            return i - 1;
+        }
+    }
+    return buffer.size();
 }
 
-template<typename T>
-void InitializeBuckets(const T& grams, TPerfectHash& ph, std::vector<std::pair<uint16_t, uint16_t>>& buckets) {
-    for (auto&& it: grams) {
-        std::string key = DumpKey(it.first);
-        uint32_t bucket = ph.Hash(key);
-        if (bucket >= buckets.size()) {
-            std::cerr << bucket << " " << buckets.size() << "\n";
+// Calls callback(text) for consecutive pieces of a UTF-8 file of about
+// chunkSize bytes, so that the whole file is never held in memory;
+// reading stops when it returns false.
+template<typename TCallback>
+static bool ForEachTextChunk(const std::string& fileName, const std::unordered_set<wchar_t>& alphabet,
+                             size_t chunkSize, TCallback&& callback)
+{
+    std::ifstream in(fileName, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    std::string buffer;
+    std::vector<char> block(chunkSize);
+    while (in) {
+        in.read(&block[0], block.size());
+        buffer.append(&block[0], in.gcount());
+        size_t end = in ? FindChunkEnd(buffer, alphabet) : buffer.size();
+        if (end == 0) {
+            continue;
+        }
+        if (!callback(buffer.substr(0, end))) {
+            return false;
         }
-        assert(bucket < buckets.size());
-        std::pair<uint16_t, uint16_t> data;
-        data.first = CityHash16(key);
-        data.second = PackInt32(it.second);
-        buckets[bucket] = data;
+        buffer.erase(0, end);
     }
+    return !in.bad();
 }
 
-bool TLangModel::Train(const std::string& fileName, const std::string& alphabetFile) {
+bool TLangModel::Train(const std::string& fileName, const std::string& alphabetFile, const TBucketLayouts& layouts) {
+    for (auto&& layout: layouts) {
+        if (!layout.IsValid()) {
+            std::cerr << "[error] wrong buckets layout" << std::endl;
+            return false;
+        }
+    }
 
-    std::cerr << "[info] loading text" << std::endl;
+    std::cerr << "[info] processing text" << std::endl;
     uint64_t trainStarTime = GetCurrentTimeMs();
     if (!Tokenizer.LoadAlphabet(alphabetFile)) {
         std::cerr << "[error] failed to load alphabet" << std::endl;
         return false;
     }
-    std::wstring trainText = UTF8ToWide(LoadFile(fileName));
-    ToLower(trainText);
-    TSentences sentences = Tokenizer.Process(trainText);
-    if (sentences.empty()) {
-        std::cerr << "[error] no sentences" << std::endl;
+    if (!Codec.Init(Tokenizer.GetAlphabet())) {
+        std::cerr << "[error] alphabet has more than 255 letters" << std::endl;
         return false;
     }
-
-    TIdSentences sentenceIds = ConvertToIds(sentences);
-
-    assert(sentences.size() == sentenceIds.size());
-    {
-        std::wstring tmp;
-        trainText.swap(tmp);
+    size_t threadsNumber = TrainThreads ? TrainThreads : std::max(std::thread::hardware_concurrency(), 1u);
+    size_t chunkSize = TrainChunkSize ? TrainChunkSize : TRAIN_CHUNK_SIZE;
+    if (TrainMemoryLimit != 0 && TrainChunkSize == 0) {
+        uint64_t limitChunkSize = TrainMemoryLimit / 4 / (TRAIN_STAGING_FACTOR * threadsNumber);
+        chunkSize = std::max<uint64_t>(std::min<uint64_t>(chunkSize, limitChunkSize), TRAIN_MIN_CHUNK_SIZE);
     }
+    uint64_t stagingMemory = TRAIN_STAGING_FACTOR * chunkSize * threadsNumber;
+    std::vector<TCount> wordCounts;
+    std::vector<TGramCounts<2>> grams2(threadsNumber);
+    std::vector<TGramCounts<3>> grams3(threadsNumber);
+
+    uint64_t fileSize = 0;
     {
-        TSentences tmp;
-        sentences.swap(tmp);
+        std::ifstream in(fileName, std::ios::binary | std::ios::ate);
+        fileSize = in ? uint64_t(in.tellg()) : 0;
     }
-
-    std::unordered_map<TGram1Key, TCount> grams1;
-    std::unordered_map<TGram2Key, TCount, TGram2KeyHash> grams2;
-    std::unordered_map<TGram3Key, TCount, TGram3KeyHash> grams3;
-
-    std::cerr << "[info] generating N-grams " << sentenceIds.size() << std::endl;
+    uint64_t processedBytes = 0;
+    uint64_t textSize = 0;
+    uint64_t sentencesNumber = 0;
     uint64_t lastTime = GetCurrentTimeMs();
-    size_t total = sentenceIds.size();
-    for (size_t i = 0; i < total; ++i) {
-        const TWordIds& words = sentenceIds[i];
 
-        for (auto w: words) {
-            grams1[w] += 1;
-            TotalWords += 1;
+    // Counters of a shard that would outgrow its part of the memory limit
+    // are spilled to sorted runs, and runs of every shard are merged at the end
+    std::vector<TGramRuns> runs2(TrainMemoryLimit != 0 ? threadsNumber : 0);
+    std::vector<TGramRuns> runs3(TrainMemoryLimit != 0 ? threadsNumber : 0);
+    std::string runsPrefix = TrainTempDir + "/jamspell_" + std::to_string(trainStarTime) + "_" +
+                             std::to_string(uintptr_t(this)) + "_";
+    auto spillShard = [&](size_t shard) {
+        std::string prefix = runsPrefix + std::to_string(shard) + "_" + std::to_string(runs2[shard].Files.size());
+        return SpillGrams<2>(grams2[shard], prefix + "_2.tmp", runs2[shard]) &&
+               SpillGrams<3>(grams3[shard], prefix + "_3.tmp", runs3[shard]);
+    };
+    auto spillFailed = [&]() {
+        std::cerr << "[error] failed to write n-grams to " << TrainTempDir << std::endl;
+        return false;
+    };
+
+    // A chunk per thread is tokenized in parallel. Words missing in the
+    // vocabulary get temporary ids after its end, from a vocabulary of the
+    // chunk, and are added in text order, so word ids and so the model
+    // don't depend on the number of threads. Then every thread takes the
+    // n-grams of its shard from all chunks and counts them.
+    std::vector<std::string> batch;
+    auto processBatch = [&]() -> bool {
+        size_t chunksNumber = batch.size();
+        TWordId knownWords = Vocabulary.Size();
+        std::vector<TVocabulary> newWords(chunksNumber);
+        std::vector<TIdSentences> sentenceIds(chunksNumber);
+        std::vector<uint64_t> textSizes(chunksNumber);
+        RunParts(chunksNumber, [&](size_t chunk) {
+            std::wstring text = UTF8ToWide(batch[chunk]);
+            ToLower(text);
+            for (auto&& words: Tokenizer.Process(text)) {
+                TWordIds ids;
+                ids.reserve(words.size());
+                for (auto&& w: words) {
+                    TWordId wid = Vocabulary.Find(w.Ptr, w.Len);
+                    if (wid == UNKNOWN_WORD_ID) {
+                        wid = knownWords + newWords[chunk].Add(w.Ptr, w.Len);
+                    }
+                    ids.push_back(wid);
+                }
+                sentenceIds[chunk].push_back(std::move(ids));
+            }
+            textSizes[chunk] = text.size();
+        });
+
+        std::vector<std::vector<TWordId>> newIds(chunksNumber);
+        for (size_t chunk = 0; chunk < chunksNumber; ++chunk) {
+            for (TWordId i = 0; i < newWords[chunk].Size(); ++i) {
+                TWord w = newWords[chunk].GetWord(i);
+                newIds[chunk].push_back(Vocabulary.Add(w.Ptr, w.Len));
+            }
+            newWords[chunk].Clear();
+            processedBytes += batch[chunk].size();
+            textSize += textSizes[chunk];
+            sentencesNumber += sentenceIds[chunk].size();
         }
-
-        for (ssize_t j = 0; j < (ssize_t)words.size() - 1; ++j) {
-            TGram2Key key(words[j], words[j+1]);
-            grams2[key] += 1;
+        wordCounts.resize(Vocabulary.Size());
+
+        // chunk -> shard -> n-grams
+        std::vector<std::vector<TWordIds>> shardedWords(chunksNumber, std::vector<TWordIds>(threadsNumber));
+        std::vector<std::vector<std::vector<std::array<TWordId, 2>>>> shardedGrams2(
+            chunksNumber, std::vector<std::vector<std::array<TWordId, 2>>>(threadsNumber));
+        std::vector<std::vector<std::vector<std::array<TWordId, 3>>>> shardedGrams3(
+            chunksNumber, std::vector<std::vector<std::array<TWordId, 3>>>(threadsNumber));
+        RunParts(chunksNumber, [&](size_t chunk) {
+            for (auto&& words: sentenceIds[chunk]) {
+                for (auto&& w: words) {
+                    if (w >= knownWords) {
+                        w = newIds[chunk][w - knownWords];
+                    }
+                    shardedWords[chunk][w % threadsNumber].push_back(w);
+                }
+                for (ssize_t j = 0; j < (ssize_t)words.size() - 1; ++j) {
+                    std::array<TWordId, 2> key = {{words[j], words[j+1]}};
+                    shardedGrams2[chunk][GramShard(key, threadsNumber)].push_back(key);
+                }
+                for (ssize_t j = 0; j < (ssize_t)words.size() - 2; ++j) {
+                    std::array<TWordId, 3> key = {{words[j], words[j+1], words[j+2]}};
+                    shardedGrams3[chunk][GramShard(key, threadsNumber)].push_back(key);
+                }
+            }
+            TIdSentences().swap(sentenceIds[chunk]);
+        });
+
+        // Counters get what's left of the limit after the vocabulary, word
+        // counts and staging of a batch, in equal parts per shard
+        uint64_t shardMemoryLimit = 0;
+        if (TrainMemoryLimit != 0) {
+            uint64_t fixedMemory = Vocabulary.MemoryUsage() + wordCounts.capacity() * sizeof(TCount) + stagingMemory;
+            if (fixedMemory >= TrainMemoryLimit) {
+                std::cerr << "[error] vocabulary and text staging take " << fixedMemory
+                          << " bytes, the memory limit is " << TrainMemoryLimit << " bytes" << std::endl;
+                return false;
+            }
+            shardMemoryLimit = std::max<uint64_t>((TrainMemoryLimit - fixedMemory) / threadsNumber, 1);
         }
-        for (ssize_t j = 0; j < (ssize_t)words.size() - 2; ++j) {
-            TGram3Key key(words[j], words[j+1], words[j+2]);
-            grams3[key] += 1;
+        std::vector<uint64_t> shardWords(threadsNumber);
+        std::vector<char> written(threadsNumber, 1);
+        RunParts(threadsNumber, [&](size_t shard) {
+            // Non-empty counters are spilled before an Add could exceed the limit
+            auto fits = [&](size_t nextAddMemory, size_t otherMemory) {
+                return shardMemoryLimit == 0 || nextAddMemory + otherMemory <= shardMemoryLimit ||
+                       grams2[shard].Size() + grams3[shard].Size() == 0;
+            };
+            for (size_t chunk = 0; chunk < chunksNumber; ++chunk) {
+                for (auto w: shardedWords[chunk][shard]) {
+                    wordCounts[w] += 1;
+                }
+                shardWords[shard] += shardedWords[chunk][shard].size();
+                for (auto&& key: shardedGrams2[chunk][shard]) {
+                    if (!fits(grams2[shard].NextAddMemoryUsage(), grams3[shard].MemoryUsage()) && !spillShard(shard)) {
+                        written[shard] = 0;
+                        return;
+                    }
+                    grams2[shard].Add(key);
+                }
+                for (auto&& key: shardedGrams3[chunk][shard]) {
+                    if (!fits(grams3[shard].NextAddMemoryUsage(), grams2[shard].MemoryUsage()) && !spillShard(shard)) {
+                        written[shard] = 0;
+                        return;
+                    }
+                    grams3[shard].Add(key);
+                }
+            }
+        });
+        if (std::find(written.begin(), written.end(), 0) != written.end()) {
+            return spillFailed();
+        }
+
+        for (auto count: shardWords) {
+            TotalWords += count;
         }
+        batch.clear();
         uint64_t currTime = GetCurrentTimeMs();
         if (currTime - lastTime > 4000) {
-            std::cerr << "[info] processed " << (100.0 * float(i) / float(total)) << "%" << std::endl;
+            std::cerr << "[info] processed " << (100.0 * double(processedBytes) / double(std::max<uint64_t>(fileSize, 1))) << "%" << std::endl;
             lastTime = currTime;
         }
+        return true;
+    };
+    bool failed = false;
+    auto processChunk = [&](std::string&& chunk) {
+        batch.push_back(std::move(chunk));
+        if (batch.size() == threadsNumber && !processBatch()) {
+            failed = true;
+            return false;
+        }
+        return true;
+    };
+    if (!ForEachTextChunk(fileName, Tokenizer.GetAlphabet(), chunkSize, processChunk)) {
+        if (!failed) {
+            std::cerr << "[error] failed to read " << fileName << std::endl;
+        }
+        return false;
+    }
+    if (!batch.empty() && !processBatch()) {
+        return false;
+    }
+    size_t spilledRuns = 0;
+    for (auto&& runs: runs2) {
+        spilledRuns += runs.Files.size();
+    }
+    if (spilledRuns != 0) {
+        std::cerr << "[info] merging " << spilledRuns + runs2.size() << " runs of n-grams" << std::endl;
+        std::vector<char> written(threadsNumber, 0);
+        RunParts(threadsNumber, [&](size_t shard) {
+            written[shard] = spillShard(shard);
+        });
+        if (std::find(written.begin(), written.end(), 0) != written.end()) {
+            return spillFailed();
+        }
+    } else {
+        runs2.clear();
+        runs3.clear();
+    }
+    if (sentencesNumber == 0) {
+        std::cerr << "[error] no sentences" << std::endl;
+        return false;
     }
+    std::cerr << "[info] sentences: " << sentencesNumber << std::endl;
+    std::cerr << "[info] vocabulary: " << Vocabulary.Size() << " words, "
+              << Vocabulary.MemoryUsage() << " bytes" << std::endl;
 
-    VocabSize = grams1.size();
+    VocabSize = wordCounts.size();
 
-    std::cerr << "[info] generating keys" << std::endl;
+    // Unigram counts bound all others, so a shared count scale keeps
+    // n-gram counts below their prefix counts after quantization.
+    TCount maxCount = 0;
+    for (auto&& count: wordCounts) {
+        maxCount = std::max(maxCount, count);
+    }
+    WordCounts.Assign(std::move(wordCounts));
 
+    std::cerr << "[info] generating perf hash" << std::endl;
+    auto records2 = ReleaseCounts(grams2);
+    auto records3 = ReleaseCounts(grams3);
+    size_t grams2size = 0;
+    size_t grams3size = 0;
+    if (!InitializeGrams(records2, runs2, runsPrefix + "merged_", maxCount, layouts[0], Grams[0], grams2size) ||
+        !InitializeGrams(records3, runs3, runsPrefix + "merged_", maxCount, layouts[1], Grams[1], grams3size))
     {
-        std::vector<std::string> keys;
-        keys.reserve(grams1.size() + grams2.size() + grams3.size());
-
-        std::cerr << "[info] ngrams1: " << grams1.size() << "\n";
-        std::cerr << "[info] ngrams2: " << grams2.size() << "\n";
-        std::cerr << "[info] ngrams3: " << grams3.size() << "\n";
-        std::cerr << "[info] total: " << grams3.size() + grams2.size() + grams1.size() << "\n";
-
-        PrepareNgramKeys(grams1, keys);
-        PrepareNgramKeys(grams2, keys);
-        PrepareNgramKeys(grams3, keys);
-
-        std::cerr << "[info] generating perf hash" << std::endl;
-
-        PerfectHash.Init(keys);
+        std::cerr << "[error] failed to build n-gram tables" << std::endl;
+        return false;
     }
 
-    std::cerr << "[info] finished, buckets: " << PerfectHash.BucketsNumber() << "\n";
+    std::cerr << "[info] ngrams1: " << VocabSize << "\n";
+    std::cerr << "[info] ngrams2: " << grams2size << "\n";
+    std::cerr << "[info] ngrams3: " << grams3size << "\n";
+    std::cerr << "[info] total: " << grams3size + grams2size + VocabSize << "\n";
 
-    Buckets.resize(PerfectHash.BucketsNumber());
-    InitializeBuckets(grams1, PerfectHash, Buckets);
-    InitializeBuckets(grams2, PerfectHash, Buckets);
-    InitializeBuckets(grams3, PerfectHash, Buckets);
-
-    std::cerr << "[info] buckets filled" << std::endl;
+    for (size_t i = 0; i < Grams.size(); ++i) {
+        const TBucketLayout& layout = Grams[i].GetLayout();
+        std::cerr << "[info] ngrams" << i + 2 << " buckets: " << Grams[i].BucketsNumber()
+                  << ", layout " << layout.FingerprintBits << ":" << layout.CountBits
+                  << ", " << Grams[i].MemoryUsage() << " bytes" << std::endl;
+    }
 
     std::stringbuf checkSumBuf;
     std::ostream checkSumOut(&checkSumBuf);
-    NHandyPack::Dump(checkSumOut, trainStarTime, grams1.size(), grams2.size(),
-                    grams3.size(), Buckets.size(), trainText.size(), sentences.size());
+    NHandyPack::Dump(checkSumOut, trainStarTime, WordCounts.size(), grams2size, grams3size,
+                     Grams[0].BucketsNumber(), Grams[1].BucketsNumber(),
+                     textSize, sentencesNumber);
     std::string checkSumStr = checkSumBuf.str();
     CheckSum = CityHash64(&checkSumStr[0], checkSumStr.size());
+    PrepareLogTables();
     return true;
 }
 
-double TLangModel::Score(const TWords& words) const {
-    TWordIds sentence;
+// Every word of a scored sentence contributes its unigram, the bigram and
+// the trigram starting at it; the sentence is padded with unknown words.
+// Unigrams are read by word id, other n-grams are looked up in a batch.
+void TLangModel::AddScoreGrams(const TWords& words, TWordIds& ids, std::vector<TGramKey>& keys) const {
+    size_t first = ids.size();
     for (auto&& w: words) {
-        sentence.push_back(GetWordIdNoCreate(w));
+        ids.push_back(GetWordIdNoCreate(w));
     }
-    if (sentence.empty()) {
-        return std::numeric_limits<double>::min();
+    ids.push_back(UnknownWordId);
+    ids.push_back(UnknownWordId);
+    const TWordId* sentence = &ids[first];
+    for (size_t i = 0; i < words.size(); ++i) {
+        keys.emplace_back(sentence[i], sentence[i + 1]);
+        keys.emplace_back(sentence[i], sentence[i + 1], sentence[i + 2]);
     }
+}
 
-    sentence.push_back(UnknownWordId);
-    sentence.push_back(UnknownWordId);
-
+double TLangModel::ScoreGrams(size_t wordsNumber, const TWordId* ids, const uint32_t* packedCounts) const {
+    if (wordsNumber == 0) {
+        return std::numeric_limits<double>::min();
+    }
     double result = 0;
-    for (size_t i = 0; i < sentence.size() - 2; ++i) {
-        result += log(GetGram1Prob(sentence[i]));
-        result += log(GetGram2Prob(sentence[i], sentence[i + 1]));
-        result += log(GetGram3Prob(sentence[i], sentence[i + 1], sentence[i + 2]));
+    for (size_t i = 0; i < wordsNumber; ++i, packedCounts += 2) {
+        result += GetGram1LogProb(ids[i]);
+        result += GetGram2LogProb(ids[i], packedCounts[0]);
+        result += GetGram3LogProb(packedCounts[0], packedCounts[1]);
     }
     return result;
 }
 
+void TLangModel::SetTrainThreads(size_t threads) {
+    TrainThreads = threads;
+}
+
+void TLangModel::SetTrainChunkSize(size_t bytes) {
+    TrainChunkSize = bytes;
+}
+
+void TLangModel::SetTrainMemoryLimit(uint64_t maxBytes, const std::string& tempDir) {
+    TrainMemoryLimit = maxBytes;
+    TrainTempDir = tempDir;
+}
+
+double TLangModel::Score(const TWords& words) const {
+    TWordIds ids;
+    std::vector<TGramKey> keys;
+    ids.reserve(words.size() + 2);
+    keys.reserve(2 * words.size());
+    AddScoreGrams(words, ids, keys);
+    std::vector<uint32_t> packedCounts(keys.size());
+    GetGramsPackedCounts(keys.data(), keys.size(), packedCounts.data());
+    return ScoreGrams(words.size(), ids.data(), packedCounts.data());
+}
+
+std::vector<double> TLangModel::Score(const std::vector<TWords>& sentences) const {
+    TWordIds ids;
+    std::vector<TGramKey> keys;
+    for (auto&& words: sentences) {
+        AddScoreGrams(words, ids, keys);
+    }
+    std::vector<uint32_t> packedCounts(keys.size());
+    GetGramsPackedCounts(keys.data(), keys.size(), packedCounts.data());
+
+    std::vector<double> scores;
+    scores.reserve(sentences.size());
+    const TWordId* sentenceIds = ids.data();
+    const uint32_t* sentenceCounts = packedCounts.data();
+    for (auto&& words: sentences) {
+        scores.push_back(ScoreGrams(words.size(), sentenceIds, sentenceCounts));
+        sentenceIds += words.size() + 2;
+        sentenceCounts += 2 * words.size();
+    }
+    return scores;
+}
+
+// Scores of the words window around position (two words on each side), with
+// each candidate put at position. Terms that do not involve the position are
+// shared by all candidates and computed once; per candidate only its unigram,
+// both bigrams and three trigrams containing it are looked up.
+std::vector<double> TLangModel::ScoreCandidatesAtPosition(const TWords& sentence,
+                                                         size_t position,
+                                                         const TWords& candidates) const
+{
+    std::vector<double> scores;
+    if (position >= sentence.size() || candidates.empty()) {
+        return scores;
+    }
+    size_t start = position >= 2 ? position - 2 : 0;
+    size_t end = std::min(sentence.size(), position + 3);
+    size_t wordsNumber = end - start;
+    size_t p = position - start;
+
+    TWordIds ids;
+    ids.reserve(wordsNumber + 2);
+    for (size_t i = start; i < end; ++i) {
+        ids.push_back(i == position ? UnknownWordId : GetWordIdNoCreate(sentence[i]));
+    }
+    ids.push_back(UnknownWordId);
+    ids.push_back(UnknownWordId);
+
+    std::vector<TGramKey> keys;
+    keys.reserve(std::max(2 * wordsNumber, 5 * candidates.size()));
+    for (size_t i = 0; i < wordsNumber; ++i) {
+        keys.emplace_back(ids[i], ids[i + 1]);
+        keys.emplace_back(ids[i], ids[i + 1], ids[i + 2]);
+    }
+    std::vector<uint32_t> context(keys.size());
+    GetGramsPackedCounts(keys.data(), keys.size(), context.data());
+
+    double contextScore = 0;
+    for (size_t i = 0; i < wordsNumber; ++i) {
+        const uint32_t* packed = &context[2 * i];
+        if (i != p) {
+            contextScore += GetGram1LogProb(ids[i]);
+        }
+        if (i + 1 < p || i > p) {
+            contextScore += GetGram2LogProb(ids[i], packed[0]);
+        }
+        if (i + 2 < p || i > p) {
+            contextScore += GetGram3LogProb(packed[0], packed[1]);
+        }
+    }
+
+    // per candidate: G2(w-1, c), G2(c, w+1), G3(w-2, w-1, c), G3(w-1, c, w+1), G3(c, w+1, w+2)
+    TWordId prev2 = p >= 2 ? ids[p - 2] : UnknownWordId;
+    TWordId prev1 = p >= 1 ? ids[p - 1] : UnknownWordId;
+    TWordId next1 = ids[p + 1];
+    TWordId next2 = ids[p + 2];
+    TWordIds candidateIds;
+    candidateIds.reserve(candidates.size());
+    keys.clear();
+    for (auto&& cand: candidates) {
+        TWordId c = GetWordIdNoCreate(cand);
+        candidateIds.push_back(c);
+        keys.emplace_back(prev1, c);
+        keys.emplace_back(c, next1);
+        keys.emplace_back(prev2, prev1, c);
+        keys.emplace_back(prev1, c, next1);
+        keys.emplace_back(c, next1, next2);
+    }
+    std::vector<uint32_t> packedCounts(keys.size());
+    GetGramsPackedCounts(keys.data(), keys.size(), packedCounts.data());
+
+    scores.reserve(candidates.size());
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        const uint32_t* packed = &packedCounts[5 * i];
+        double score = contextScore;
+        score += GetGram1LogProb(candidateIds[i]);
+        score += GetGram2LogProb(candidateIds[i], packed[1]);
+        score += GetGram3LogProb(packed[1], packed[4]);
+        if (p >= 1) {
+            score += GetGram2LogProb(prev1, packed[0]);
+            score += GetGram3LogProb(packed[0], packed[3]);
+        }
+        if (p >= 2) {
+            score += GetGram3LogProb(context[2 * (p - 2)], packed[2]);
+        }
+        scores.push_back(score);
+    }
+    return scores;
+}
+
 double TLangModel::Score(const std::wstring& str) const {
     TSentences sentences = Tokenizer.Process(str);
     TWords words;
@@ -225,107 +655,136 @@ double TLangModel::Score(const std::wstring& str) const {
     return Score(words);
 }
 
+constexpr uint32_t LANG_MODEL_SECTION_META = 1;
+constexpr uint32_t LANG_MODEL_SECTION_WORD_COUNTS = 2;
+constexpr uint32_t LANG_MODEL_SECTION_WORDS_POOL = 4;
+constexpr uint32_t LANG_MODEL_SECTION_WORDS_OFFSETS = 5;
+constexpr uint32_t LANG_MODEL_SECTION_WORDS_INDEX = 6;
+constexpr uint32_t LANG_MODEL_SECTION_BUCKETS[] = {7, 9};
+constexpr uint32_t LANG_MODEL_SECTION_PHF_DISPLACEMENTS[] = {8, 10};
+
 bool TLangModel::Dump(const std::string& modelFileName) const {
-    std::ofstream out(modelFileName, std::ios::binary);
-    if (!out.is_open()) {
-        return false;
-    }
-    NHandyPack::Dump(out, LANG_MODEL_MAGIC_BYTE);
-    NHandyPack::Dump(out, LANG_MODEL_VERSION);
-    Dump(out);
-    NHandyPack::Dump(out, LANG_MODEL_MAGIC_BYTE);
-    return true;
+    std::stringbuf metaBuf;
+    std::ostream meta(&metaBuf);
+    uint32_t wcharSize = sizeof(wchar_t);
+    NHandyPack::Dump(meta, TotalWords, VocabSize, Tokenizer, CheckSum, wcharSize);
+    for (auto&& grams: Grams) {
+        grams.DumpParams(meta);
+    }
+
+    TSectionsWriter writer;
+    writer.Add(LANG_MODEL_SECTION_META, metaBuf.str());
+    writer.Add(LANG_MODEL_SECTION_WORD_COUNTS, WordCounts);
+    for (size_t i = 0; i < Grams.size(); ++i) {
+        Grams[i].Dump(writer, LANG_MODEL_SECTION_BUCKETS[i], LANG_MODEL_SECTION_PHF_DISPLACEMENTS[i]);
+    }
+    Vocabulary.Dump(writer, LANG_MODEL_SECTION_WORDS_POOL,
+                    LANG_MODEL_SECTION_WORDS_OFFSETS, LANG_MODEL_SECTION_WORDS_INDEX);
+    return writer.Write(modelFileName, LANG_MODEL_MAGIC_BYTE, LANG_MODEL_VERSION);
 }
 
 bool TLangModel::Load(const std::string& modelFileName) {
-    std::ifstream in(modelFileName, std::ios::binary);
-    if (!in.is_open()) {
+    std::unique_ptr<TMappedSections> modelFile(new TMappedSections());
+    if (!modelFile->Open(modelFileName, LANG_MODEL_MAGIC_BYTE, LANG_MODEL_VERSION)) {
+        uint16_t version = 0;
+        if (ReadFileVersion(modelFileName, LANG_MODEL_MAGIC_BYTE, version) && version < LANG_MODEL_VERSION) {
+            std::cerr << "[error] " << modelFileName << " has an old model format (version " << version
+                      << ", expected " << LANG_MODEL_VERSION << "), retrain it with this version" << std::endl;
+        }
         return false;
     }
-    uint16_t version = 0;
-    uint64_t magicByte = 0;
-    NHandyPack::Load(in, magicByte);
-    if (magicByte != LANG_MODEL_MAGIC_BYTE) {
+    Clear();
+
+    const char* meta = nullptr;
+    size_t metaSize = 0;
+    if (!modelFile->Get(LANG_MODEL_SECTION_META, meta, metaSize)) {
         return false;
     }
-    NHandyPack::Load(in, version);
-    if (version != LANG_MODEL_VERSION) {
-        return false;
+    {
+        NHandyPack::imemstream in(meta, metaSize);
+        uint32_t wcharSize = 0;
+        NHandyPack::Load(in, TotalWords, VocabSize, Tokenizer, CheckSum, wcharSize);
+        for (auto&& grams: Grams) {
+            grams.LoadParams(in);
+        }
+        if (!in || wcharSize != sizeof(wchar_t) || !Codec.Init(Tokenizer.GetAlphabet())) {
+            Clear();
+            return false;
+        }
     }
-    Load(in);
-    magicByte = 0;
-    NHandyPack::Load(in, magicByte);
-    if (magicByte != LANG_MODEL_MAGIC_BYTE) {
+
+    for (size_t i = 0; i < Grams.size(); ++i) {
+        if (!Grams[i].Load(*modelFile, LANG_MODEL_SECTION_BUCKETS[i], LANG_MODEL_SECTION_PHF_DISPLACEMENTS[i])) {
+            Clear();
+            return false;
+        }
+    }
+
+    if (!Vocabulary.Load(*modelFile, LANG_MODEL_SECTION_WORDS_POOL,
+                         LANG_MODEL_SECTION_WORDS_OFFSETS, LANG_MODEL_SECTION_WORDS_INDEX) ||
+        !modelFile->Get(LANG_MODEL_SECTION_WORD_COUNTS, WordCounts) ||
+        WordCounts.size() != Vocabulary.Size())
+    {
         Clear();
         return false;
     }
-    IdToWord.clear();
-    IdToWord.resize(WordToId.size() + 1, nullptr);
-    for (auto&& it: WordToId) {
-        IdToWord[it.second] = &it.first;
-    }
+    PrepareLogTables();
+    ModelFile = std::move(modelFile);
     return true;
 }
 
 void TLangModel::Clear() {
     K = LANG_MODEL_DEFAULT_K;
-    WordToId.clear();
-    LastWordID = 0;
     TotalWords = 0;
+    VocabSize = 0;
     Tokenizer.Clear();
-}
-
-const TRobinHash& TLangModel::GetWordToId() {
-    return WordToId;
-}
-
-TIdSentences TLangModel::ConvertToIds(const TSentences& sentences) {
-    TIdSentences newSentences;
-    for (size_t i = 0; i < sentences.size(); ++i) {
-        const TWords& words = sentences[i];
-        TWordIds wordIds;
-        for (size_t j = 0; j < words.size(); ++j) {
-            const TWord& word = words[j];
-            wordIds.push_back(GetWordId(word));
-        }
-        newSentences.push_back(wordIds);
-    }
-    return newSentences;
+    Codec.Clear();
+    for (auto&& grams: Grams) {
+        grams.Clear();
+    }
+    WordCounts.Clear();
+    Vocabulary.Clear();
+    for (size_t i = 0; i < Grams.size(); ++i) {
+        LogCountsK[i].clear();
+    }
+    LogCountsTotal.clear();
+    LogWordCountsK.clear();
+    LogWordCountsTotal.clear();
+    ModelFile.reset();
 }
 
 TWordId TLangModel::GetWordId(const TWord& word) {
     assert(word.Ptr && word.Len);
     assert(word.Len < 10000);
-    std::wstring w(word.Ptr, word.Len);
-    auto it = WordToId.find(w);
-    if (it != WordToId.end()) {
-        return it->second;
-    }
-    TWordId wordId = LastWordID;
-    ++LastWordID;
-    it = WordToId.insert(std::make_pair(w, wordId)).first;
-    IdToWord.push_back(&(it->first));
-    return wordId;
+    return Vocabulary.Add(word.Ptr, word.Len);
 }
 
 TWordId TLangModel::GetWordIdNoCreate(const TWord& word) const {
-    std::wstring w(word.Ptr, word.Len);
-    auto it = WordToId.find(w);
-    if (it != WordToId.end()) {
-        return it->second;
+    if (word.Id != UNRESOLVED_WORD_ID) {
+        return word.Id;
     }
-    return UnknownWordId;
+    return Vocabulary.Find(word.Ptr, word.Len);
 }
 
-TWord TLangModel::GetWordById(TWordId wid) const {
-    if (wid >= IdToWord.size()) {
-        return TWord();
+void TLangModel::ResolveWordIds(TWords& words) const {
+    for (auto&& w: words) {
+        w.Id = GetWordIdNoCreate(w);
     }
-    return TWord(*IdToWord[wid]);
+}
+
+TWord TLangModel::GetWordById(TWordId wid) const {
+    return Vocabulary.GetWord(wid);
 }
 
 TCount TLangModel::GetWordCount(TWordId wid) const {
-    return GetGram1HashCount(wid);
+    if (wid >= WordCounts.size()) {
+        return TCount();
+    }
+    return WordCounts[wid];
+}
+
+TWordId TLangModel::GetWordsNumber() const {
+    return Vocabulary.Size();
 }
 
 uint64_t TLangModel::GetCheckSum() const {
@@ -333,97 +792,154 @@ uint64_t TLangModel::GetCheckSum() const {
 }
 
 TWord TLangModel::GetWord(const std::wstring& word) const {
-    auto it = WordToId.find(word);
-    if (it != WordToId.end()) {
-        return TWord(&it->first[0], it->first.size());
-    }
-    return TWord();
+    return Vocabulary.GetWord(Vocabulary.Find(word.data(), word.size()));
+}
+
+TWord TLangModel::GetWord(const TWord& word) const {
+    return Vocabulary.GetWord(GetWordIdNoCreate(word));
 }
 
 const std::unordered_set<wchar_t>& TLangModel::GetAlphabet() const {
     return Tokenizer.GetAlphabet();
 }
 
+const TAlphabetCodec& TLangModel::GetCodec() const {
+    return Codec;
+}
+
 TSentences TLangModel::Tokenize(const std::wstring& text) const {
     return Tokenizer.Process(text);
 }
 
-double TLangModel::GetGram1Prob(TWordId word) const {
-    double countsGram1 = GetGram1HashCount(word);
-    countsGram1 += K;
-    return countsGram1 / (TotalWords + VocabSize);
+// Probabilities are (count + K) / (prefix count + TotalWords); a count
+// above its prefix count comes from a hash collision and is dropped.
+double TLangModel::GetGram1LogProb(TWordId word) const {
+    TCount count = GetWordCount(word);
+    if (count < LogWordCountsK.size()) {
+        return LogWordCountsK[count] - LogGram1Total;
+    }
+    return log(count + K) - LogGram1Total;
 }
 
-double TLangModel::GetGram2Prob(TWordId word1, TWordId word2) const {
-    double countsGram1 = GetGram1HashCount(word1);
-    double countsGram2 = GetGram2HashCount(word1, word2);
-    if (countsGram2 > countsGram1) { // (hash collision)
-        countsGram2 = 0;
+double TLangModel::GetGram2LogProb(TWordId word1, uint32_t packedGram2) const {
+    TCount count = GetWordCount(word1);
+    double logTotal = count < LogWordCountsTotal.size() ? LogWordCountsTotal[count] : log(count + TotalWords);
+    if (Grams[0].Unpack(packedGram2) > count) {
+        return LogK - logTotal;
     }
-    countsGram1 += TotalWords;
-    countsGram2 += K;
-    return countsGram2 / countsGram1;
+    return LogCountsK[0][packedGram2] - logTotal;
 }
 
-double TLangModel::GetGram3Prob(TWordId word1, TWordId word2, TWordId word3) const {
-    double countsGram2 = GetGram2HashCount(word1, word2);
-    double countsGram3 = GetGram3HashCount(word1, word2, word3);
-    if (countsGram3 > countsGram2) { // hash collision
-        countsGram3 = 0;
+double TLangModel::GetGram3LogProb(uint32_t packedGram2, uint32_t packedGram3) const {
+    if (Grams[1].Unpack(packedGram3) > Grams[0].Unpack(packedGram2)) {
+        return LogK - LogCountsTotal[packedGram2];
     }
-    countsGram2 += TotalWords;
-    countsGram3 += K;
-    return countsGram3 / countsGram2;
+    return LogCountsK[1][packedGram3] - LogCountsTotal[packedGram2];
 }
 
-template<typename T>
-TCount GetGramHashCount(T key,
-                        const TPerfectHash& ph,
-                        const std::vector<std::pair<uint16_t, uint16_t>>& buckets)
-{
-    constexpr int TMP_BUF_SIZE = 128;
-    static char tmpBuff[TMP_BUF_SIZE];
-    static MemStream tmpBuffStream(tmpBuff, TMP_BUF_SIZE - 1);
-    static std::ostream out(&tmpBuffStream);
-
-    tmpBuffStream.Reset();
-
-    NHandyPack::Dump(out, key);
+// Word counts are tabulated up to MAX_TABULATED_WORD_COUNT, only a handful of
+// the most frequent words are above it.
+constexpr TCount MAX_TABULATED_WORD_COUNT = 65536;
 
-    uint32_t bucket = ph.Hash(tmpBuff, tmpBuffStream.Size());
+void TLangModel::PrepareLogTables() {
+    for (size_t i = 0; i < Grams.size(); ++i) {
+        const TGramTable& grams = Grams[i];
+        std::vector<double> logCountsK(grams.PackedCountsNumber());
+        for (uint32_t packed = 0; packed < grams.PackedCountsNumber(); ++packed) {
+            logCountsK[packed] = log(grams.Unpack(packed) + K);
+        }
+        LogCountsK[i].swap(logCountsK);
+    }
+    LogCountsTotal.resize(Grams[0].PackedCountsNumber());
+    for (uint32_t packed = 0; packed < LogCountsTotal.size(); ++packed) {
+        LogCountsTotal[packed] = log(double(Grams[0].Unpack(packed)) + TotalWords);
+    }
 
-    assert(bucket < ph.BucketsNumber());
-    const std::pair<uint16_t, uint16_t>& data = buckets[bucket];
+    TCount maxCount = 0;
+    for (auto&& count: WordCounts) {
+        maxCount = std::max(maxCount, count);
+    }
+    size_t wordCountsSize = std::min(maxCount, MAX_TABULATED_WORD_COUNT) + 1;
+    LogWordCountsK.resize(wordCountsSize);
+    LogWordCountsTotal.resize(wordCountsSize);
+    for (TCount count = 0; count < wordCountsSize; ++count) {
+        LogWordCountsK[count] = log(count + K);
+        LogWordCountsTotal[count] = log(count + TotalWords);
+    }
+    LogK = log(K);
+    LogGram1Total = log(double(TotalWords) + double(VocabSize));
+}
 
-    TCount res = TCount();
-    if (data.first == CityHash16(tmpBuff, tmpBuffStream.Size())) {
-        res = UnpackInt32(data.second);
+void TLangModel::GetGramsCounts(const TGramKey* keys, size_t size, TCount* counts) const {
+    static_assert(sizeof(TCount) == sizeof(uint32_t), "counts are unpacked in place");
+    uint32_t* packedCounts = (uint32_t*)counts;
+    GetGramsPackedCounts(keys, size, packedCounts);
+    for (size_t i = 0; i < size; ++i) {
+        if (keys[i].Order == 1) {
+            counts[i] = GetWordCount(keys[i].Words[0]);
+        } else {
+            counts[i] = Grams[keys[i].Order - 2].Unpack(packedCounts[i]);
+        }
     }
-    return res;
 }
 
-TCount TLangModel::GetGram1HashCount(TWordId word) const {
-    if (word == UnknownWordId) {
-        return TCount();
+// Unigrams are not stored in tables, their packed counts are left 0
+static inline bool IsTableGram(const TGramKey& key, TWordId unknownWordId) {
+    return key.Order > 1 && !key.Contains(unknownWordId);
+}
+
+void TLangModel::GetGramsPackedCounts(const TGramKey* keys, size_t size, uint32_t* packedCounts) const {
+    constexpr size_t BATCH_SIZE = 32;
+    uint64_t hashes[BATCH_SIZE];
+    uint32_t positions[BATCH_SIZE];
+
+    for (size_t start = 0; start < size; start += BATCH_SIZE) {
+        size_t batchSize = std::min(BATCH_SIZE, size - start);
+        const TGramKey* batchKeys = keys + start;
+        uint32_t* batchCounts = packedCounts + start;
+
+        // hash everything and prefetch perfect hash displacements
+        for (size_t i = 0; i < batchSize; ++i) {
+            if (!IsTableGram(batchKeys[i], UnknownWordId)) {
+                continue;
+            }
+            const TGramTable& table = Grams[batchKeys[i].Order - 2];
+            hashes[i] = batchKeys[i].Hash();
+            positions[i] = table.DisplacementSlot(hashes[i]);
+            table.PrefetchDisplacement(positions[i]);
+        }
+        // resolve buckets and prefetch them
+        for (size_t i = 0; i < batchSize; ++i) {
+            if (!IsTableGram(batchKeys[i], UnknownWordId)) {
+                continue;
+            }
+            const TGramTable& table = Grams[batchKeys[i].Order - 2];
+            positions[i] = table.Bucket(hashes[i], positions[i]);
+            table.PrefetchBucket(positions[i]);
+        }
+        // read counts
+        for (size_t i = 0; i < batchSize; ++i) {
+            batchCounts[i] = 0;
+            if (!IsTableGram(batchKeys[i], UnknownWordId)) {
+                continue;
+            }
+            batchCounts[i] = Grams[batchKeys[i].Order - 2].GetPacked(hashes[i], positions[i]);
+        }
     }
-    TGram1Key key = word;
-    return GetGramHashCount(key, PerfectHash, Buckets);
 }
 
 TCount TLangModel::GetGram2HashCount(TWordId word1, TWordId word2) const {
     if (word1 == UnknownWordId || word2 == UnknownWordId) {
         return TCount();
     }
-    TGram2Key key({word1, word2});
-    return GetGramHashCount(key, PerfectHash, Buckets);
+    return Grams[0].Get(TPackedGram<2>(word1, word2).Hash());
 }
 
 TCount TLangModel::GetGram3HashCount(TWordId word1, TWordId word2, TWordId word3) const {
     if (word1 == UnknownWordId || word2 == UnknownWordId || word3 == UnknownWordId) {
         return TCount();
     }
-    TGram3Key key(word1, word2, word3);
-    return GetGramHashCount(key, PerfectHash, Buckets);
+    return Grams[1].Get(TPackedGram<3>(word1, word2, word3).Hash());
 }
 
 } // NJamSpell
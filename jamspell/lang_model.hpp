@@ -5,103 +5,106 @@
 #include <utility>
 #include <string>
 #include <limits>
+#include <memory>
 
 #include <contrib/handypack/handypack.hpp>
-#include <contrib/tsl/robin_map.h>
 #include "utils.hpp"
-#include "perfect_hash.hpp"
+#include "gram_table.hpp"
+#include "gram_key.hpp"
+#include "mapped_file.hpp"
+#include "vocabulary.hpp"
 
 
 namespace NJamSpell {
 
 
 constexpr uint64_t LANG_MODEL_MAGIC_BYTE = 8559322735408079685L;
-constexpr uint16_t LANG_MODEL_VERSION = 9;
+constexpr uint16_t LANG_MODEL_VERSION = 14;
 constexpr double LANG_MODEL_DEFAULT_K = 0.05;
 
-using TWordId = uint32_t;
-using TCount = uint32_t;
-
-using TGram1Key = TWordId;
-using TGram2Key = std::pair<TWordId, TWordId>;
-using TGram3Key = std::tuple<TWordId, TWordId, TWordId>;
 using TWordIds = std::vector<TWordId>;
 using TIdSentences = std::vector<TWordIds>;
 
-struct TGram2KeyHash {
-public:
-  std::size_t operator()(const TGram2Key& x) const {
-      return (size_t)x.first ^ ((size_t)x.second << 16);
-  }
-};
-
-struct TGram3KeyHash {
-public:
-  std::size_t operator()(const TGram3Key& x) const {
-    return (size_t)std::get<0>(x) ^
-            ((size_t)std::get<1>(x) << 16) ^
-            ((size_t)std::get<2>(x) << 32);
-  }
-};
-
-class TRobinSerializer: public NHandyPack::TUnorderedMapSerializer<tsl::robin_map<std::wstring, TWordId>, std::wstring, TWordId> {};
-class TRobinHash: public tsl::robin_map<std::wstring, TWordId> {
-public:
-    inline virtual void Dump(std::ostream& out) const {
-        TRobinSerializer::Dump(out, *this);
-    }
-    inline virtual void Load(std::istream& in) {
-        TRobinSerializer::Load(in, *this);
-    }
-};
-
 class TLangModel {
 public:
-    bool Train(const std::string& fileName, const std::string& alphabetFile);
+    bool Train(const std::string& fileName, const std::string& alphabetFile,
+               const TBucketLayouts& layouts = TBucketLayouts());
+    // Threads used to train the model, 0 - all cores; the model is the same for any number
+    void SetTrainThreads(size_t threads);
+    // Bytes of text a thread tokenizes at once, 0 - default (4Mb); the model doesn't depend on it
+    void SetTrainChunkSize(size_t bytes);
+    // Above maxBytes (0 - no limit) n-gram counts are spilled to sorted runs
+    // in tempDir and merged when the text is over, so memory used for
+    // counting doesn't depend on the corpus size
+    void SetTrainMemoryLimit(uint64_t maxBytes, const std::string& tempDir = ".");
     double Score(const TWords& words) const;
     double Score(const std::wstring& str) const;
+    std::vector<double> Score(const std::vector<TWords>& sentences) const;
+    // Same as scoring the words around position with each candidate put there
+    std::vector<double> ScoreCandidatesAtPosition(const TWords& sentence, size_t position,
+                                                  const TWords& candidates) const;
     TWord GetWord(const std::wstring& word) const;
+    TWord GetWord(const TWord& word) const;
     const std::unordered_set<wchar_t>& GetAlphabet() const;
+    const TAlphabetCodec& GetCodec() const;
     TSentences Tokenize(const std::wstring& text) const;
 
     bool Dump(const std::string& modelFileName) const;
     bool Load(const std::string& modelFileName);
     void Clear();
 
-    const TRobinHash& GetWordToId();
-
     TWordId GetWordId(const TWord& word);
-    TWordId GetWordIdNoCreate(const TWord& word) const;
+    TWordId GetWordIdNoCreate(const TWord& word) const; // uses word id when it is already set
+    void ResolveWordIds(TWords& words) const;
     TWord GetWordById(TWordId wid) const;
     TCount GetWordCount(TWordId wid) const;
+    TWordId GetWordsNumber() const;
 
     uint64_t GetCheckSum() const;
 
-    HANDYPACK(WordToId, LastWordID, TotalWords, VocabSize,
-              PerfectHash, Buckets, Tokenizer, CheckSum)
+    // Resolves counts of many n-grams at once: hashes are computed first and
+    // table reads are prefetched, so cache misses of the keys overlap.
+    void GetGramsCounts(const TGramKey* keys, size_t size, TCount* counts) const;
 private:
-    TIdSentences ConvertToIds(const TSentences& sentences);
+    void AddScoreGrams(const TWords& words, TWordIds& ids, std::vector<TGramKey>& keys) const;
+    double ScoreGrams(size_t wordsNumber, const TWordId* ids, const uint32_t* packedCounts) const;
+    void GetGramsPackedCounts(const TGramKey* keys, size_t size, uint32_t* packedCounts) const;
 
-    double GetGram1Prob(TWordId word) const;
-    double GetGram2Prob(TWordId word1, TWordId word2) const;
-    double GetGram3Prob(TWordId word1, TWordId word2, TWordId word3) const;
+    void PrepareLogTables();
+    double GetGram1LogProb(TWordId word) const;
+    double GetGram2LogProb(TWordId word1, uint32_t packedGram2) const;
+    double GetGram3LogProb(uint32_t packedGram2, uint32_t packedGram3) const;
 
-    TCount GetGram1HashCount(TWordId word) const;
     TCount GetGram2HashCount(TWordId word1, TWordId word2) const;
     TCount GetGram3HashCount(TWordId word1, TWordId word2, TWordId word3) const;
 
 private:
-    const TWordId UnknownWordId = std::numeric_limits<TWordId>::max();
+    const TWordId UnknownWordId = UNKNOWN_WORD_ID;
     double K = LANG_MODEL_DEFAULT_K;
-    TRobinHash WordToId;
-    std::vector<const std::wstring*> IdToWord;
-    TWordId LastWordID = 0;
     TWordId TotalWords = 0;
     TWordId VocabSize = 0;
     TTokenizer Tokenizer;
-    std::vector<std::pair<uint16_t, uint16_t>> Buckets;
-    TPerfectHash PerfectHash;
+    TAlphabetCodec Codec;
     uint64_t CheckSum;
+    size_t TrainThreads = 0;
+    size_t TrainChunkSize = 0;
+    uint64_t TrainMemoryLimit = 0;
+    std::string TrainTempDir = ".";
+
+    // Tables below are either built by Train or point into ModelFile
+    TFlatArray<TCount> WordCounts; // exact unigram counts by word id
+    std::array<TGramTable, 2> Grams; // n-grams of orders 2, 3
+
+    // Scoring terms by packed count (or word count for unigrams):
+    // log(count + K) and log(count + TotalWords), built on Train / Load
+    std::array<std::vector<double>, 2> LogCountsK;
+    std::vector<double> LogCountsTotal;
+    std::vector<double> LogWordCountsK;
+    std::vector<double> LogWordCountsTotal;
+    double LogK = 0;
+    double LogGram1Total = 0;
+    TVocabulary Vocabulary;
+    std::unique_ptr<TMappedSections> ModelFile;
 };
 
 
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace NJamSpell {
+
+struct TLruCacheStats {
+    uint64_t Hits = 0;
+    uint64_t Misses = 0;
+    uint64_t Evictions = 0;
+    uint64_t Size = 0;
+};
+
+// Bounded map that drops least recently used items, safe to use from many
+// threads. Keys are spread over shards with their own lock and LRU list, so
+// threads rarely wait for each other; recency is tracked per shard.
+template<typename TKey, typename TValue, typename THash = std::hash<TKey>>
+class TLruCache {
+public:
+    explicit TLruCache(size_t maxSize, size_t shardsNumber = 16) {
+        shardsNumber = std::max<size_t>(std::min(shardsNumber, maxSize), 1);
+        for (size_t i = 0; i < shardsNumber; ++i) {
+            Shards.emplace_back(new TShard());
+            Shards.back()->MaxSize = std::max<size_t>(maxSize / shardsNumber + (i < maxSize % shardsNumber), 1);
+        }
+    }
+
+    // Copies the value and marks it as recently used
+    bool Get(const TKey& key, TValue& value) {
+        TShard& shard = GetShard(key);
+        std::lock_guard<std::mutex> lock(shard.Lock);
+        auto it = shard.Index.find(key);
+        if (it == shard.Index.end()) {
+            shard.Stats.Misses += 1;
+            return false;
+        }
+        shard.Items.splice(shard.Items.begin(), shard.Items, it->second);
+        value = it->second->second;
+        shard.Stats.Hits += 1;
+        return true;
+    }
+
+    void Put(const TKey& key, TValue value) {
+        TShard& shard = GetShard(key);
+        std::lock_guard<std::mutex> lock(shard.Lock);
+        auto it = shard.Index.find(key);
+        if (it != shard.Index.end()) {
+            it->second->second = std::move(value);
+            shard.Items.splice(shard.Items.begin(), shard.Items, it->second);
+            return;
+        }
+        if (shard.Items.size() >= shard.MaxSize) {
+            shard.Index.erase(shard.Items.back().first);
+            shard.Items.pop_back();
+            shard.Stats.Evictions += 1;
+        }
+        shard.Items.emplace_front(key, std::move(value));
+        shard.Index[key] = shard.Items.begin();
+    }
+
+    void Clear() {
+        for (auto&& shard: Shards) {
+            std::lock_guard<std::mutex> lock(shard->Lock);
+            shard->Items.clear();
+            shard->Index.clear();
+            shard->Stats = TLruCacheStats();
+        }
+    }
+
+    TLruCacheStats GetStats() const {
+        TLruCacheStats stats;
+        for (auto&& shard: Shards) {
+            std::lock_guard<std::mutex> lock(shard->Lock);
+            stats.Hits += shard->Stats.Hits;
+            stats.Misses += shard->Stats.Misses;
+            stats.Evictions += shard->Stats.Evictions;
+            stats.Size += shard->Items.size();
+        }
+        return stats;
+    }
+private:
+    typedef std::list<std::pair<TKey, TValue>> TItems; // most recently used first
+    struct TShard {
+        mutable std::mutex Lock;
+        TItems Items;
+        std::unordered_map<TKey, typename TItems::iterator, THash> Index;
+        size_t MaxSize = 0;
+        TLruCacheStats Stats;
+    };
+
+    TShard& GetShard(const TKey& key) {
+        // High bits, as the shard map buckets by low ones
+        uint64_t hash = uint64_t(THash()(key)) * 0x9E3779B97F4A7C15ULL;
+        return *Shards[(hash >> 32) % Shards.size()];
+    }
+private:
+    std::vector<std::unique_ptr<TShard>> Shards;
+};
+
+} // NJamSpell
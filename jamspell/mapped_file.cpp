@@ -0,0 +1,255 @@
+#include <atomic>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+
+#ifndef _WIN32
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#else
+    #include <process.h>
+#endif
+
+#include "mapped_file.hpp"
+
+namespace NJamSpell {
+
+TMemoryMappedFile::TMemoryMappedFile()
+    : Ptr(nullptr)
+    , FileSize(0)
+{
+}
+
+TMemoryMappedFile::~TMemoryMappedFile() {
+    Close();
+}
+
+bool TMemoryMappedFile::Open(const std::string& fileName) {
+    Close();
+#ifndef _WIN32
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        return false;
+    }
+    Ptr = (const char*)ptr;
+    FileSize = st.st_size;
+#else
+    std::ifstream in(fileName, std::ios::binary | std::ios::ate);
+    if (!in.is_open()) {
+        return false;
+    }
+    std::streamoff size = in.tellg();
+    if (size <= 0) {
+        return false;
+    }
+    Buffer.resize(size);
+    in.seekg(0);
+    if (!in.read(&Buffer[0], size)) {
+        Buffer.clear();
+        return false;
+    }
+    Ptr = &Buffer[0];
+    FileSize = Buffer.size();
+#endif
+    return true;
+}
+
+void TMemoryMappedFile::Close() {
+    if (!Ptr) {
+        return;
+    }
+#ifndef _WIN32
+    munmap((void*)Ptr, FileSize);
+#else
+    std::vector<char>().swap(Buffer);
+#endif
+    Ptr = nullptr;
+    FileSize = 0;
+}
+
+const char* TMemoryMappedFile::Data() const {
+    return Ptr;
+}
+
+size_t TMemoryMappedFile::Size() const {
+    return FileSize;
+}
+
+constexpr size_t HEADER_SIZE = 8 + 2 + 2 + 4;
+constexpr size_t SECTION_RECORD_SIZE = 4 + 4 + 8 + 8;
+
+template<typename T>
+static void WritePod(std::ostream& out, const T& value) {
+    out.write((const char*)&value, sizeof(T));
+}
+
+template<typename T>
+static T ReadPod(const char* data) {
+    T value;
+    memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+static uint64_t AlignUp(uint64_t offset) {
+    return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+}
+
+void TSectionsWriter::Add(uint32_t id, const void* data, size_t size) {
+    Sections.push_back({id, (const char*)data, size});
+}
+
+void TSectionsWriter::Add(uint32_t id, const std::string& data) {
+    OwnedData.emplace_back(new std::string(data));
+    Add(id, OwnedData.back()->data(), OwnedData.back()->size());
+}
+
+// Creates an empty file with a name no other writer uses, next to fileName
+static bool CreateTempFile(const std::string& fileName, std::string& tmpFileName) {
+#ifndef _WIN32
+    std::vector<char> name(fileName.begin(), fileName.end());
+    const std::string suffix = ".XXXXXX";
+    name.insert(name.end(), suffix.begin(), suffix.end());
+    name.push_back(0);
+    int fd = mkstemp(&name[0]);
+    if (fd < 0) {
+        return false;
+    }
+    fchmod(fd, 0644); // mkstemp creates files readable by the owner only
+    close(fd);
+    tmpFileName = &name[0];
+#else
+    static std::atomic<uint64_t> counter(0);
+    tmpFileName = fileName + "." + std::to_string(_getpid()) + "_" + std::to_string(counter++) + ".tmp";
+#endif
+    return true;
+}
+
+bool TSectionsWriter::Write(const std::string& fileName, uint64_t magic, uint16_t version) const {
+    // The file may be mapped by other processes, so it is never truncated in
+    // place: a new file is written and renamed over the old one. Processes
+    // writing the same file at once each use a temporary file of their own.
+    std::string tmpFileName;
+    if (!CreateTempFile(fileName, tmpFileName)) {
+        return false;
+    }
+    if (!WriteFile(tmpFileName, magic, version)) {
+        std::remove(tmpFileName.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    std::remove(fileName.c_str());
+#endif
+    return std::rename(tmpFileName.c_str(), fileName.c_str()) == 0;
+}
+
+bool TSectionsWriter::WriteFile(const std::string& fileName, uint64_t magic, uint16_t version) const {
+    std::ofstream out(fileName, std::ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+    WritePod(out, magic);
+    WritePod(out, version);
+    WritePod(out, uint16_t(0));
+    WritePod(out, uint32_t(Sections.size()));
+
+    uint64_t offset = AlignUp(HEADER_SIZE + SECTION_RECORD_SIZE * Sections.size());
+    std::vector<uint64_t> offsets;
+    for (auto&& s: Sections) {
+        WritePod(out, s.Id);
+        WritePod(out, uint32_t(0));
+        WritePod(out, offset);
+        WritePod(out, uint64_t(s.Size));
+        offsets.push_back(offset);
+        offset = AlignUp(offset + s.Size);
+    }
+
+    const std::vector<char> padding(SECTION_ALIGNMENT, 0);
+    uint64_t pos = HEADER_SIZE + SECTION_RECORD_SIZE * Sections.size();
+    for (size_t i = 0; i < Sections.size(); ++i) {
+        out.write(&padding[0], offsets[i] - pos);
+        out.write(Sections[i].Data, Sections[i].Size);
+        pos = offsets[i] + Sections[i].Size;
+    }
+    return out.good();
+}
+
+bool TMappedSections::Open(const std::string& fileName, uint64_t magic, uint16_t version) {
+    return Open(fileName, magic, version, version);
+}
+
+bool TMappedSections::Open(const std::string& fileName, uint64_t magic, uint16_t minVersion, uint16_t maxVersion) {
+    Sections.clear();
+    Version = 0;
+    if (!File.Open(fileName)) {
+        return false;
+    }
+    const char* data = File.Data();
+    size_t size = File.Size();
+    if (size < HEADER_SIZE ||
+        ReadPod<uint64_t>(data) != magic ||
+        ReadPod<uint16_t>(data + 8) < minVersion ||
+        ReadPod<uint16_t>(data + 8) > maxVersion)
+    {
+        File.Close();
+        return false;
+    }
+    uint32_t sectionsCount = ReadPod<uint32_t>(data + 12);
+    if (HEADER_SIZE + uint64_t(sectionsCount) * SECTION_RECORD_SIZE > size) {
+        File.Close();
+        return false;
+    }
+    for (uint32_t i = 0; i < sectionsCount; ++i) {
+        const char* record = data + HEADER_SIZE + i * SECTION_RECORD_SIZE;
+        TSection section;
+        section.Id = ReadPod<uint32_t>(record);
+        section.Offset = ReadPod<uint64_t>(record + 8);
+        section.Size = ReadPod<uint64_t>(record + 16);
+        if (section.Offset > size || section.Size > size - section.Offset) {
+            Sections.clear();
+            File.Close();
+            return false;
+        }
+        Sections.push_back(section);
+    }
+    Version = ReadPod<uint16_t>(data + 8);
+    return true;
+}
+
+bool ReadFileVersion(const std::string& fileName, uint64_t magic, uint16_t& version) {
+    std::ifstream in(fileName, std::ios::binary);
+    char header[10];
+    if (!in.read(header, sizeof(header)) || ReadPod<uint64_t>(header) != magic) {
+        return false;
+    }
+    version = ReadPod<uint16_t>(header + 8);
+    return true;
+}
+
+uint16_t TMappedSections::GetVersion() const {
+    return Version;
+}
+
+bool TMappedSections::Get(uint32_t id, const char*& data, size_t& size) const {
+    for (auto&& s: Sections) {
+        if (s.Id == id) {
+            data = File.Data() + s.Offset;
+            size = s.Size;
+            return true;
+        }
+    }
+    return false;
+}
+
+} // NJamSpell
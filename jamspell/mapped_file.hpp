@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <cassert>
+
+namespace NJamSpell {
+
+// Read-only view of a whole file. Uses mmap where available, so several
+// processes loading the same model share its pages.
+class TMemoryMappedFile {
+public:
+    TMemoryMappedFile();
+    TMemoryMappedFile(const TMemoryMappedFile& other) = delete;
+    ~TMemoryMappedFile();
+    bool Open(const std::string& fileName);
+    void Close();
+    const char* Data() const;
+    size_t Size() const;
+private:
+    const char* Ptr;
+    size_t FileSize;
+    std::vector<char> Buffer; // used when mmap is not available
+};
+
+// Array that either owns its elements or points into external memory
+// (a memory mapped file section).
+template<typename T>
+class TFlatArray {
+public:
+    TFlatArray()
+        : Ptr(nullptr)
+        , Size(0)
+    {
+    }
+    TFlatArray(const TFlatArray& other) = delete;
+    TFlatArray& operator=(const TFlatArray& other) = delete;
+
+    void Assign(std::vector<T>&& data) {
+        Owned = std::move(data);
+        Update();
+    }
+    void View(const T* ptr, size_t size) {
+        std::vector<T>().swap(Owned);
+        Ptr = ptr;
+        Size = size;
+    }
+    void Clear() {
+        std::vector<T>().swap(Owned);
+        Ptr = nullptr;
+        Size = 0;
+    }
+
+    // Growing is only possible for owned arrays
+    void PushBack(const T& value) {
+        assert(IsOwned());
+        Owned.push_back(value);
+        Update();
+    }
+    void Append(const T* begin, const T* end) {
+        assert(IsOwned());
+        Owned.insert(Owned.end(), begin, end);
+        Update();
+    }
+    T* MutableData() {
+        assert(IsOwned());
+        return Owned.empty() ? nullptr : &Owned[0];
+    }
+
+    const T* data() const {
+        return Ptr;
+    }
+    size_t size() const {
+        return Size;
+    }
+    bool empty() const {
+        return Size == 0;
+    }
+    const T& operator[](size_t i) const {
+        return Ptr[i];
+    }
+    const T* begin() const {
+        return Ptr;
+    }
+    const T* end() const {
+        return Ptr + Size;
+    }
+    size_t MemoryUsage() const {
+        return Owned.capacity() * sizeof(T);
+    }
+private:
+    bool IsOwned() const {
+        return Ptr == nullptr || (!Owned.empty() && Ptr == &Owned[0]);
+    }
+    void Update() {
+        Ptr = Owned.empty() ? nullptr : &Owned[0];
+        Size = Owned.size();
+    }
+    std::vector<T> Owned;
+    const T* Ptr;
+    size_t Size;
+};
+
+constexpr size_t SECTION_ALIGNMENT = 4096;
+
+// File of page-aligned binary sections, identified by numeric id:
+//   magic (8) | version (2) | reserved (2) | sections count (4)
+//   section table: id (4) | reserved (4) | offset (8) | size (8)
+//   sections, each starting at a SECTION_ALIGNMENT boundary
+// Sections store arrays in native (little-endian) layout, so they can be
+// used in place right after mapping the file.
+class TSectionsWriter {
+public:
+    void Add(uint32_t id, const void* data, size_t size);
+    void Add(uint32_t id, const std::string& data);
+    template<typename T>
+    void Add(uint32_t id, const TFlatArray<T>& data) {
+        Add(id, data.data(), data.size() * sizeof(T));
+    }
+    bool Write(const std::string& fileName, uint64_t magic, uint16_t version) const;
+private:
+    bool WriteFile(const std::string& fileName, uint64_t magic, uint16_t version) const;
+    struct TSection {
+        uint32_t Id;
+        const char* Data;
+        size_t Size;
+    };
+    std::vector<TSection> Sections;
+    std::vector<std::unique_ptr<std::string>> OwnedData;
+};
+
+class TMappedSections {
+public:
+    bool Open(const std::string& fileName, uint64_t magic, uint16_t version);
+    // Accepts any version in the range, GetVersion() tells which one was read
+    bool Open(const std::string& fileName, uint64_t magic, uint16_t minVersion, uint16_t maxVersion);
+    uint16_t GetVersion() const;
+    bool Get(uint32_t id, const char*& data, size_t& size) const;
+    template<typename T>
+    bool Get(uint32_t id, TFlatArray<T>& result) const {
+        const char* data = nullptr;
+        size_t size = 0;
+        if (!Get(id, data, size) || size % sizeof(T) != 0) {
+            return false;
+        }
+        result.View((const T*)data, size / sizeof(T));
+        return true;
+    }
+private:
+    struct TSection {
+        uint32_t Id;
+        uint64_t Offset;
+        uint64_t Size;
+    };
+    TMemoryMappedFile File;
+    std::vector<TSection> Sections;
+    uint16_t Version = 0;
+};
+
+// Reads the version of a file with the given magic, also of older formats
+// that can't be opened; false if the file can't be read or has another magic
+bool ReadFileVersion(const std::string& fileName, uint64_t magic, uint16_t& version);
+
+} // NJamSpell
@@ -2,12 +2,27 @@
 #include <contrib/phf/phf.h>
 
 #include "perfect_hash.hpp"
+#include "utils.hpp"
 
 #include <cassert>
 
 namespace NJamSpell {
 
 void TPerfectHash::Dump(std::ostream& out) const {
+    DumpParams(out);
+    out.write(DisplacementsData(), DisplacementsSize());
+}
+
+void TPerfectHash::Load(std::istream& in) {
+    LoadParams(in);
+    phf& perfHash = *(phf*)Phf;
+    size_t size = DisplacementsSize();
+    perfHash.g = (uint32_t*)calloc(size, 1);
+    OwnsDisplacements = true;
+    in.read((char*)perfHash.g, size);
+}
+
+void TPerfectHash::DumpParams(std::ostream& out) const {
     const phf& perfHash = *(const phf*)Phf;
     NHandyPack::Dump(out, perfHash.d_max,
                          perfHash.g_op,
@@ -15,10 +30,9 @@ void TPerfectHash::Dump(std::ostream& out) const {
                          perfHash.r,
                          perfHash.seed,
                          perfHash.nodiv);
-    out.write((const char*)perfHash.g, perfHash.r * sizeof(uint32_t));
 }
 
-void TPerfectHash::Load(std::istream& in) {
+void TPerfectHash::LoadParams(std::istream& in) {
     Clear();
     Phf = new phf();
     phf& perfHash = *(phf*)Phf;
@@ -28,11 +42,46 @@ void TPerfectHash::Load(std::istream& in) {
                         perfHash.r,
                         perfHash.seed,
                         perfHash.nodiv);
-    perfHash.g = (uint32_t*)calloc(perfHash.r, sizeof(uint32_t));
-    in.read((char*)perfHash.g, perfHash.r * sizeof(uint32_t));
+}
+
+const char* TPerfectHash::DisplacementsData() const {
+    assert(Phf && "Not initialized");
+    return (const char*)((const phf*)Phf)->g;
+}
+
+static size_t DisplacementBytes(const phf& perfHash) {
+    switch (perfHash.g_op) {
+    case phf::PHF_G_UINT8_MOD_R:
+    case phf::PHF_G_UINT8_BAND_R:
+        return sizeof(uint8_t);
+    case phf::PHF_G_UINT16_MOD_R:
+    case phf::PHF_G_UINT16_BAND_R:
+        return sizeof(uint16_t);
+    default:
+        return sizeof(uint32_t);
+    }
+}
+
+size_t TPerfectHash::DisplacementsSize() const {
+    assert(Phf && "Not initialized");
+    const phf& perfHash = *(const phf*)Phf;
+    return perfHash.r * DisplacementBytes(perfHash);
+}
+
+void TPerfectHash::SetDisplacements(const char* data) {
+    assert(Phf && "Not initialized");
+    phf& perfHash = *(phf*)Phf;
+    if (OwnsDisplacements) {
+        free(perfHash.g);
+    }
+    perfHash.g = (uint32_t*)data;
+    OwnsDisplacements = false;
 }
 
 bool TPerfectHash::Init(const std::vector<std::string>& keys) {
+    if (keys.empty()) {
+        return false;
+    }
     std::vector<phf_string_t> keysForPhf;
     keysForPhf.reserve(keys.size());
     for (const std::string& s: keys) {
@@ -40,7 +89,7 @@ bool TPerfectHash::Init(const std::vector<std::string>& keys) {
     }
 
     phf* tempPhf = new phf();
-    phf_error_t res = PHF::init<phf_string_t, false>(tempPhf, &keysForPhf[0], keysForPhf.size(), 4, 80, 42);
+    phf_error_t res = PHF::init<phf_string_t, false>(tempPhf, keysForPhf.data(), keysForPhf.size(), 4, 80, 42);
     if (res != 0) {
         PHF::destroy(tempPhf);
         delete tempPhf;
@@ -48,6 +97,25 @@ bool TPerfectHash::Init(const std::vector<std::string>& keys) {
     }
     Clear();
     Phf = tempPhf;
+    OwnsDisplacements = true;
+    return true;
+}
+
+bool TPerfectHash::Init(const std::vector<uint64_t>& keys) {
+    if (keys.empty()) {
+        return false;
+    }
+    phf* tempPhf = new phf();
+    phf_error_t res = PHF::init<uint64_t, false>(tempPhf, keys.data(), keys.size(), 4, 80, 42);
+    if (res != 0) {
+        PHF::destroy(tempPhf);
+        delete tempPhf;
+        return false;
+    }
+    PHF::compact(tempPhf);
+    Clear();
+    Phf = tempPhf;
+    OwnsDisplacements = true;
     return true;
 }
 
@@ -55,8 +123,12 @@ void TPerfectHash::Clear() {
     if (!Phf) {
         return;
     }
+    if (!OwnsDisplacements) {
+        ((phf*)Phf)->g = nullptr;
+    }
     PHF::destroy((phf*)Phf);
     delete (phf*)Phf;
+    Phf = nullptr;
 }
 
 uint32_t TPerfectHash::Hash(const std::string& value) const {
@@ -70,6 +142,68 @@ uint32_t TPerfectHash::Hash(const char* value, size_t size) const {
     return PHF::hash<phf_string_t>((phf*)Phf, phfValue);
 }
 
+uint32_t TPerfectHash::Hash(uint64_t value) const {
+    assert(Phf && "Not initialized");
+    return PHF::hash<uint64_t>((phf*)Phf, value);
+}
+
+// Same as phf_g() / phf_f() for 64-bit keys in contrib/phf/phf.cc, which are
+// not exported; the phf tables are only usable if these stay in sync.
+static inline uint32_t PhfRound32(uint32_t k1, uint32_t h1) {
+    k1 *= UINT32_C(0xcc9e2d51);
+    k1 = (k1 << 15) | (k1 >> 17);
+    k1 *= UINT32_C(0x1b873593);
+    h1 ^= k1;
+    h1 = (h1 << 13) | (h1 >> 19);
+    return h1 * 5 + UINT32_C(0xe6546b64);
+}
+
+static inline uint32_t PhfMix32(uint32_t h1) {
+    h1 ^= h1 >> 16;
+    h1 *= UINT32_C(0x85ebca6b);
+    h1 ^= h1 >> 13;
+    h1 *= UINT32_C(0xc2b2ae35);
+    h1 ^= h1 >> 16;
+    return h1;
+}
+
+uint32_t TPerfectHash::DisplacementSlot(uint64_t value) const {
+    const phf& perfHash = *(const phf*)Phf;
+    uint32_t h1 = perfHash.seed;
+    h1 = PhfRound32(uint32_t(value), h1);
+    h1 = PhfRound32(uint32_t(value >> 32), h1);
+    h1 = PhfMix32(h1);
+    return perfHash.nodiv ? (h1 & (perfHash.r - 1)) : (h1 % perfHash.r);
+}
+
+void TPerfectHash::PrefetchDisplacement(uint32_t slot) const {
+    const phf& perfHash = *(const phf*)Phf;
+    Prefetch((const char*)perfHash.g + slot * DisplacementBytes(perfHash));
+}
+
+uint32_t TPerfectHash::Hash(uint64_t value, uint32_t slot) const {
+    const phf& perfHash = *(const phf*)Phf;
+    uint32_t d = 0;
+    switch (perfHash.g_op) {
+    case phf::PHF_G_UINT8_MOD_R:
+    case phf::PHF_G_UINT8_BAND_R:
+        d = ((const uint8_t*)perfHash.g)[slot];
+        break;
+    case phf::PHF_G_UINT16_MOD_R:
+    case phf::PHF_G_UINT16_BAND_R:
+        d = ((const uint16_t*)perfHash.g)[slot];
+        break;
+    default:
+        d = perfHash.g[slot];
+    }
+    uint32_t h1 = perfHash.seed;
+    h1 = PhfRound32(d, h1);
+    h1 = PhfRound32(uint32_t(value), h1);
+    h1 = PhfRound32(uint32_t(value >> 32), h1);
+    h1 = PhfMix32(h1);
+    return perfHash.nodiv ? (h1 & (perfHash.m - 1)) : (h1 % perfHash.m);
+}
+
 uint32_t TPerfectHash::BucketsNumber() const {
     const phf* p = (phf*)Phf;
     return p->m;
@@ -77,6 +211,7 @@ uint32_t TPerfectHash::BucketsNumber() const {
 
 TPerfectHash::TPerfectHash()
     : Phf(nullptr)
+    , OwnsDisplacements(true)
 {
 }
 
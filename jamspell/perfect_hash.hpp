@@ -1,6 +1,9 @@
 #pragma once
 
 #include <ostream>
+#include <vector>
+#include <string>
+#include <cstdint>
 
 namespace NJamSpell {
 
@@ -11,13 +14,33 @@ public:
     ~TPerfectHash();
     void Dump(std::ostream& out) const;
     void Load(std::istream& in);
+
+    // Parameters and displacement table separately, for memory mapped models:
+    // after LoadParams the table must be provided with SetDisplacements, it is
+    // used in place and should outlive the hash.
+    void DumpParams(std::ostream& out) const;
+    void LoadParams(std::istream& in);
+    const char* DisplacementsData() const;
+    size_t DisplacementsSize() const;
+    void SetDisplacements(const char* data);
+
+    // Keys must be unique, false for no keys
     bool Init(const std::vector<std::string>& keys);
+    bool Init(const std::vector<uint64_t>& keys);
     void Clear();
     uint32_t Hash(const std::string& value) const;
     uint32_t Hash(const char* value, size_t size) const;
+    uint32_t Hash(uint64_t value) const;
+
+    // Two-step lookup of 64-bit values, used to prefetch in batches:
+    // Hash(value, DisplacementSlot(value)) == Hash(value)
+    uint32_t DisplacementSlot(uint64_t value) const;
+    void PrefetchDisplacement(uint32_t slot) const;
+    uint32_t Hash(uint64_t value, uint32_t slot) const;
     uint32_t BucketsNumber() const;
 private:
     void* Phf; // sort of forward declaration
+    bool OwnsDisplacements;
 };
 
 } // NJamSpell
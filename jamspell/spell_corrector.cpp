@@ -1,56 +1,62 @@
 #include <algorithm>
 #include <fstream>
+#include <iostream>
+#include <queue>
+#include <sstream>
+#include <thread>
+
+#include <contrib/cityhash/city.h>
 
 #include "spell_corrector.hpp"
 
 namespace NJamSpell {
 
-
-static std::vector<std::wstring> GetDeletes1(const std::wstring& w) {
-    std::vector<std::wstring> results;
-    for (size_t i = 0; i < w.size(); ++i) {
-        auto nw = w.substr(0, i) + w.substr(i+1);
-        if (!nw.empty()) {
-            results.push_back(nw);
-        }
-    }
-    return results;
-}
-
-static std::vector<std::vector<std::wstring>> GetDeletes2(const std::wstring& w) {
-    std::vector<std::vector<std::wstring>> results;
-    for (size_t i = 0; i < w.size(); ++i) {
-        auto nw = w.substr(0, i) + w.substr(i+1);
-        if (!nw.empty()) {
-            std::vector<std::wstring> currResults = GetDeletes1(nw);
-            currResults.push_back(nw);
-            results.push_back(currResults);
-        }
-    }
-    return results;
-}
+// Filters are not made smaller than that to fit a memory limit
+constexpr double SPELL_CHECKER_CACHE_MAX_FALSE_POSITIVE_RATE = 0.5;
 
 bool TSpellCorrector::LoadLangModel(const std::string& modelFile) {
+    if (CandidatesCache) {
+        CandidatesCache->Clear();
+    }
+    CandidatesTable.reset();
     if (!LangModel.Load(modelFile)) {
         return false;
     }
-    std::string cacheFile = modelFile + ".spell";
+    std::string cacheFile = GetCacheFile(modelFile);
     if (!LoadCache(cacheFile)) {
-        PrepareCache();
+        if (!PrepareCache()) {
+            return false;
+        }
         SaveCache(cacheFile);
     }
+    std::unique_ptr<TCandidatesTable> table(new TCandidatesTable());
+    if (table->Load(GetCandidatesTableFile(modelFile), LangModel.GetCheckSum())) {
+        if (table->GetCandidatesEngine() != CandidatesEngine) {
+            std::cerr << "[info] precomputed candidates are skipped, they were built with candidates engine "
+                      << table->GetCandidatesEngine() << std::endl;
+            return true;
+        }
+        std::cerr << "[info] loaded precomputed candidates of " << table->Size() << " words" << std::endl;
+        CandidatesTable = std::move(table);
+    }
     return true;
 }
 
 bool TSpellCorrector::TrainLangModel(const std::string& textFile, const std::string& alphabetFile, const std::string& modelFile) {
+    if (CandidatesCache) {
+        CandidatesCache->Clear();
+    }
+    CandidatesTable.reset();
     if (!LangModel.Train(textFile, alphabetFile)) {
         return false;
     }
-    PrepareCache();
+    if (!PrepareCache()) {
+        return false;
+    }
     if (!LangModel.Dump(modelFile)) {
         return false;
     }
-    std::string cacheFile = modelFile + ".spell";
+    std::string cacheFile = GetCacheFile(modelFile);
     if (!SaveCache(cacheFile)) {
         return false;
     }
@@ -65,50 +71,49 @@ TScoredWords TSpellCorrector::GetCandidatesRawWithScores(const TWords& sentence,
     }
 
     TWord w = sentence[position];
-    TWords candidates = Edits2(w);
-
     bool firstLevel = true;
     bool knownWord = false;
-    if (candidates.empty()) {
-        candidates = Edits(w);
-        firstLevel = false;
+    TWords candidates;
+    TWordCandidates cached;
+    bool found = false;
+    if (CandidatesTable && CandidatesTable->GetMaxCandidatesToCheck() == MaxCandidatesToCheck &&
+        CandidatesTable->GetCandidatesEngine() == CandidatesEngine)
+    {
+        found = CandidatesTable->Find(w.Ptr, w.Len, cached);
+    }
+    std::wstring key;
+    if (!found && CandidatesCache) {
+        key.assign(w.Ptr, w.Len);
+        found = CandidatesCache->Get(key, cached);
+    }
+    if (found) {
+        firstLevel = cached.FirstLevel;
+        knownWord = cached.KnownWord;
+        if (knownWord) {
+            w = LangModel.GetWord(w);
+        }
+        candidates.reserve(cached.Ids.size());
+        for (TWordId wid: cached.Ids) {
+            candidates.push_back(wid == UNKNOWN_WORD_ID ? w : LangModel.GetWordById(wid));
+        }
+    } else {
+        candidates = GenerateCandidates(w, firstLevel, knownWord);
+        if (CandidatesCache) {
+            CandidatesCache->Put(key, GetCandidateIds(candidates, w, firstLevel, knownWord));
+        }
     }
 
     if (candidates.empty()) {
         return scoredCandidates;
     }
+    scoredCandidates.reserve(candidates.size());
 
-    {
-        TWord c = LangModel.GetWord(std::wstring(w.Ptr, w.Len));
-        if (c.Ptr && c.Len) {
-            w = c;
-            candidates.push_back(c);
-            knownWord = true;
-        } else {
-            candidates.push_back(w);
-        }
-    }
-
-    std::unordered_set<TWord, TWordHashPtr> uniqueCandidates(candidates.begin(), candidates.end());
-
-    FilterCandidatesByFrequency(uniqueCandidates, w);
-    scoredCandidates.reserve(uniqueCandidates.size());
-
-    for (TWord cand: uniqueCandidates) {
-        TWords candSentence;
-        for (size_t i = 0; i < sentence.size(); ++i) {
-            if (i == position) {
-                candSentence.push_back(cand);
-            } else if ((i < position && i + 2 >= position) ||
-                       (i > position && i <= position + 2))
-            {
-                candSentence.push_back(sentence[i]);
-            }
-        }
+    std::vector<double> scores = LangModel.ScoreCandidatesAtPosition(sentence, position, candidates);
 
+    for (size_t i = 0; i < candidates.size(); ++i) {
         TScoredWord scored;
-        scored.Word = cand;
-        scored.Score = LangModel.Score(candSentence);
+        scored.Word = candidates[i];
+        scored.Score = scores[i];
         if (!(scored.Word == w)) {
             if (knownWord) {
                 if (firstLevel) {
@@ -129,6 +134,101 @@ TScoredWords TSpellCorrector::GetCandidatesRawWithScores(const TWords& sentence,
     return scoredCandidates;
 }
 
+// Candidates in scoring order, including the word itself; the word is
+// replaced with its vocabulary copy if it's known
+TWords TSpellCorrector::GenerateCandidates(TWord& w, bool& firstLevel, bool& knownWord) const {
+    TWords candidates = Edits2(w);
+    firstLevel = true;
+    knownWord = false;
+    if (candidates.empty()) {
+        candidates = Edits(w);
+        firstLevel = false;
+    }
+
+    if (candidates.empty()) {
+        return candidates;
+    }
+
+    {
+        TWord c = LangModel.GetWord(w);
+        if (c.Ptr && c.Len) {
+            w = c;
+            candidates.push_back(c);
+            knownWord = true;
+        } else {
+            candidates.push_back(w);
+        }
+    }
+
+    std::unordered_set<TWord, TWordHashPtr> uniqueCandidates(candidates.begin(), candidates.end());
+
+    FilterCandidatesByFrequency(uniqueCandidates, w);
+    candidates.assign(uniqueCandidates.begin(), uniqueCandidates.end());
+    return candidates;
+}
+
+TWordCandidates TSpellCorrector::GetCandidateIds(const TWords& candidates, const TWord& w,
+                                                 bool firstLevel, bool knownWord) const
+{
+    TWordCandidates result;
+    result.FirstLevel = firstLevel;
+    result.KnownWord = knownWord;
+    result.Ids.reserve(candidates.size());
+    for (auto&& c: candidates) {
+        result.Ids.push_back(c == w && !knownWord ? UNKNOWN_WORD_ID : LangModel.GetWordIdNoCreate(c));
+    }
+    return result;
+}
+
+bool TSpellCorrector::BuildCandidatesTable(const std::string& textFile, size_t maxWords, const std::string& modelFile,
+                                           bool knownWords)
+{
+    std::wstring text = UTF8ToWide(LoadFile(textFile));
+    if (text.empty()) {
+        std::cerr << "[error] empty text " << textFile << std::endl;
+        return false;
+    }
+    ToLower(text);
+    std::unordered_map<std::wstring, uint64_t> counts;
+    for (auto&& sentence: LangModel.Tokenize(text)) {
+        for (auto&& w: sentence) {
+            if (knownWords || LangModel.GetWordIdNoCreate(w) == UNKNOWN_WORD_ID) {
+                counts[std::wstring(w.Ptr, w.Len)] += 1;
+            }
+        }
+    }
+    std::vector<std::pair<uint64_t, std::wstring>> frequent;
+    frequent.reserve(counts.size());
+    for (auto&& it: counts) {
+        frequent.push_back(std::make_pair(it.second, it.first));
+    }
+    std::sort(frequent.begin(), frequent.end(), [](const std::pair<uint64_t, std::wstring>& a,
+                                                   const std::pair<uint64_t, std::wstring>& b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    });
+    frequent.resize(std::min(frequent.size(), maxWords));
+
+    std::vector<std::pair<std::wstring, TWordCandidates>> words;
+    words.reserve(frequent.size());
+    for (auto&& f: frequent) {
+        TWord w(f.second);
+        bool firstLevel = true;
+        bool knownWord = false;
+        TWords candidates = GenerateCandidates(w, firstLevel, knownWord);
+        words.push_back(std::make_pair(f.second, GetCandidateIds(candidates, w, firstLevel, knownWord)));
+    }
+    std::unique_ptr<TCandidatesTable> table(new TCandidatesTable());
+    table->Build(words, MaxCandidatesToCheck, CandidatesEngine);
+    if (!table->Dump(GetCandidatesTableFile(modelFile), LangModel.GetCheckSum())) {
+        std::cerr << "[error] failed to save candidates table" << std::endl;
+        return false;
+    }
+    std::cerr << "[info] precomputed candidates of " << table->Size() << " words out of "
+              << counts.size() << (knownWords ? "" : " unknown") << std::endl;
+    CandidatesTable = std::move(table);
+    return true;
+}
+
 bool TSpellCorrector::WordIsKnown(const std::wstring& word) const {
     TWord w = LangModel.GetWord(word);
     if (w.Ptr && w.Len) {
@@ -207,6 +307,7 @@ std::wstring TSpellCorrector::FixFragment(const std::wstring& text) const {
     size_t origPos = 0;
     for (size_t i = 0; i < sentences.size(); ++i) {
         TWords words = sentences[i];
+        LangModel.ResolveWordIds(words);
         const TWords& origWords = origSentences[i];
         for (size_t j = 0; j < words.size(); ++j) {
             TWord orig = origWords[j];
@@ -220,18 +321,16 @@ std::wstring TSpellCorrector::FixFragment(const std::wstring& text) const {
                 result.push_back(text[origPos]);
                 origPos += 1;
             }
-            std::wstring newWord = std::wstring(words[j].Ptr, words[j].Len);
-            std::wstring origWord = std::wstring(orig.Ptr, orig.Len);
-            std::wstring origLowered = std::wstring(lowered.Ptr, lowered.Len);
-            if (newWord != origLowered) {
-                for (size_t k = 0; k < newWord.size(); ++k) {
-                    size_t n = k < origWord.size() ? k : origWord.size() - 1;
-                    wchar_t newChar = newWord[k];
-                    wchar_t origChar = origWord[n];
+            const TWord& newWord = words[j];
+            if (newWord.Len != lowered.Len || !std::equal(newWord.Ptr, newWord.Ptr + newWord.Len, lowered.Ptr)) {
+                for (size_t k = 0; k < newWord.Len; ++k) {
+                    size_t n = k < orig.Len ? k : orig.Len - 1;
+                    wchar_t newChar = newWord.Ptr[k];
+                    wchar_t origChar = orig.Ptr[n];
                     result.push_back(MakeUpperIfRequired(newChar, origChar));
                 }
             } else {
-                result += origWord;
+                result.append(orig.Ptr, orig.Len);
             }
             origPos += orig.Len;
         }
@@ -250,12 +349,14 @@ std::wstring TSpellCorrector::FixFragmentNormalized(const std::wstring& text) co
     std::wstring result;
     for (size_t i = 0; i < sentences.size(); ++i) {
         TWords words = sentences[i];
+        LangModel.ResolveWordIds(words);
         for (size_t i = 0; i < words.size(); ++i) {
             TWords candidates = GetCandidatesRaw(words, i);
             if (candidates.size() > 0) {
                 words[i] = candidates[0];
             }
-            result += std::wstring(words[i].Ptr, words[i].Len) + L" ";
+            result.append(words[i].Ptr, words[i].Len);
+            result += L' ';
         }
         if (words.size() > 0) {
             result.resize(result.size() - 1);
@@ -275,6 +376,44 @@ void TSpellCorrector::SetPenalty(double knownWordsPenalty, double unknownWordsPe
 
 void TSpellCorrector::SetMaxCandidatesToCheck(size_t maxCandidatesToCheck) {
     MaxCandidatesToCheck = maxCandidatesToCheck;
+    if (CandidatesCache) {
+        CandidatesCache->Clear();
+    }
+}
+
+void TSpellCorrector::SetCandidatesEngine(ECandidatesEngine engine) {
+    CandidatesEngine = engine;
+}
+
+void TSpellCorrector::SetDeletesFilter(EDeletesFilter filter) {
+    DeletesFilter = filter;
+}
+
+void TSpellCorrector::SetCacheThreads(size_t threads) {
+    CacheThreads = threads;
+}
+
+void TSpellCorrector::SetTrainThreads(size_t threads) {
+    LangModel.SetTrainThreads(threads);
+}
+
+bool TSpellCorrector::SetDeletesCacheLimits(double falsePositiveRate, uint64_t maxSize) {
+    if (!(falsePositiveRate > 0.0 && falsePositiveRate <= SPELL_CHECKER_CACHE_MAX_FALSE_POSITIVE_RATE)) {
+        std::cerr << "[error] deletes false positive rate should be in (0, "
+                  << SPELL_CHECKER_CACHE_MAX_FALSE_POSITIVE_RATE << "], got " << falsePositiveRate << std::endl;
+        return false;
+    }
+    DeletesFalsePositiveRate = falsePositiveRate;
+    DeletesCacheMaxSize = maxSize;
+    return true;
+}
+
+void TSpellCorrector::SetCandidatesCacheSize(size_t maxWords) {
+    CandidatesCache.reset(maxWords ? new TCandidatesCache(maxWords) : nullptr);
+}
+
+TLruCacheStats TSpellCorrector::GetCandidatesCacheStats() const {
+    return CandidatesCache ? CandidatesCache->GetStats() : TLruCacheStats();
 }
 
 const TLangModel& TSpellCorrector::GetLangModel() const {
@@ -286,91 +425,108 @@ inline void AddVec(T& target, const T& source) {
     target.insert(target.end(), source.begin(), source.end());
 }
 
-TWords TSpellCorrector::Edits(const TWord& word) const {
-    std::wstring w(word.Ptr, word.Len);
+TWords TSpellCorrector::DawgCandidates(const TWord& word, size_t maxDistance) const {
+    TWordIds ids;
+    Dawg->FindCandidates(word.Ptr, word.Len, maxDistance, ids);
     TWords result;
-
-    std::vector<std::vector<std::wstring>> cands = GetDeletes2(w);
-    cands.push_back(std::vector<std::wstring>({w}));
-
-    for (auto&& w1: cands) {
-        for (auto&& w: w1) {
-            TWord c = LangModel.GetWord(w);
-            if (c.Ptr && c.Len) {
-                result.push_back(c);
-            }
-            std::string s = WideToUTF8(w);
-            if (Deletes1->Contains(s)) {
-                Inserts(w, result);
-            }
-            if (Deletes2->Contains(s)) {
-                Inserts2(w, result);
-            }
-        }
+    result.reserve(ids.size());
+    for (TWordId wid: ids) {
+        result.push_back(LangModel.GetWordById(wid));
     }
+    return result;
+}
 
+TWords TSpellCorrector::Edits(const TWord& word) const {
+    if (Dawg) {
+        return DawgCandidates(word, 2);
+    }
+    TWords result;
+    if (DeletesIndex) {
+        TWordIds ids;
+        DeletesIndex->Find(word.Ptr, word.Len, ids);
+        result.reserve(ids.size());
+        for (TWordId wid: ids) {
+            result.push_back(LangModel.GetWordById(wid));
+        }
+        return result;
+    }
+    const TAlphabetCodec& codec = LangModel.GetCodec();
+    std::string coded;
+    codec.Encode(word.Ptr, word.Len, coded);
+    std::wstring decoded;
+    auto check = [&](const char* ptr, size_t len) {
+        codec.Decode(ptr, len, decoded);
+        TWord c = LangModel.GetWord(TWord(decoded.data(), len));
+        if (c.Ptr && c.Len) {
+            result.push_back(c);
+        }
+        if (Deletes1->Contains(ptr, len)) {
+            Inserts(decoded.data(), len, result);
+        }
+        if (Deletes2->Contains(ptr, len)) {
+            Inserts2(ptr, len, result);
+        }
+    };
+    ForEachDelete2(coded.data(), coded.size(), [&](const char* ptr, size_t len, int) {
+        check(ptr, len);
+    });
+    check(coded.data(), coded.size());
     return result;
 }
 
+// All variants are built in place in a single buffer; the vocabulary is
+// probed with pointer and length, so no strings are allocated per variant.
 TWords TSpellCorrector::Edits2(const TWord& word, bool lastLevel) const {
-    std::wstring w(word.Ptr, word.Len);
+    if (Dawg && lastLevel) {
+        return DawgCandidates(word, 1);
+    }
+    const wchar_t* w = word.Ptr;
+    const size_t len = word.Len;
     TWords result;
 
-    for (size_t i = 0; i < w.size() + 1; ++i) {
+    std::wstring buffer(len + 1, 0);
+    wchar_t* s = &buffer[0];
+    auto check = [&](size_t sLen) {
+        TWord c = LangModel.GetWord(TWord(s, sLen));
+        if (c.Ptr && c.Len) {
+            result.push_back(c);
+        }
+        if (!lastLevel) {
+            AddVec(result, Edits2(TWord(s, sLen)));
+        }
+    };
+
+    for (size_t i = 0; i < len + 1; ++i) {
         // delete
-        if (i < w.size()) {
-            std::wstring s = w.substr(0, i) + w.substr(i+1);
-            TWord c = LangModel.GetWord(s);
-            if (c.Ptr && c.Len) {
-                result.push_back(c);
-            }
-            if (!lastLevel) {
-                AddVec(result, Edits2(TWord(s)));
-            }
+        if (i < len) {
+            std::copy(w, w + i, s);
+            std::copy(w + i + 1, w + len, s + i);
+            check(len - 1);
         }
 
         // transpose
-        if (i + 1 < w.size()) {
-            std::wstring s = w.substr(0, i);
-            s += w.substr(i + 1, 1);
-            s += w.substr(i, 1);
-            if (i + 2 < w.size()) {
-                s += w.substr(i+2);
-            }
-            TWord c = LangModel.GetWord(s);
-            if (c.Ptr && c.Len) {
-                result.push_back(c);
-            }
-            if (!lastLevel) {
-                AddVec(result, Edits2(TWord(s)));
-            }
+        if (i + 1 < len) {
+            std::copy(w, w + len, s);
+            std::swap(s[i], s[i + 1]);
+            check(len);
         }
 
         // replace
-        if (i < w.size()) {
+        if (i < len) {
+            std::copy(w, w + len, s);
             for (auto&& ch: LangModel.GetAlphabet()) {
-                std::wstring s = w.substr(0, i) + ch + w.substr(i+1);
-                TWord c = LangModel.GetWord(s);
-                if (c.Ptr && c.Len) {
-                    result.push_back(c);
-                }
-                if (!lastLevel) {
-                    AddVec(result, Edits2(TWord(s)));
-                }
+                s[i] = ch;
+                check(len);
             }
         }
 
         // inserts
         {
+            std::copy(w, w + i, s);
+            std::copy(w + i, w + len, s + i + 1);
             for (auto&& ch: LangModel.GetAlphabet()) {
-                std::wstring s = w.substr(0, i) + ch + w.substr(i);
-                TWord c = LangModel.GetWord(s);
-                if (c.Ptr && c.Len) {
-                    result.push_back(c);
-                }
-                if (!lastLevel) {
-                    AddVec(result, Edits2(TWord(s)));
-                }
+                s[i] = ch;
+                check(len + 1);
             }
         }
     }
@@ -378,11 +534,15 @@ TWords TSpellCorrector::Edits2(const TWord& word, bool lastLevel) const {
     return result;
 }
 
-void TSpellCorrector::Inserts(const std::wstring& w, TWords& result) const {
-    for (size_t i = 0; i < w.size() + 1; ++i) {
+void TSpellCorrector::Inserts(const wchar_t* w, size_t len, TWords& result) const {
+    std::wstring buffer(len + 1, 0);
+    wchar_t* s = &buffer[0];
+    for (size_t i = 0; i < len + 1; ++i) {
+        std::copy(w, w + i, s);
+        std::copy(w + i, w + len, s + i + 1);
         for (auto&& ch: LangModel.GetAlphabet()) {
-            std::wstring s = w.substr(0, i) + ch + w.substr(i);
-            TWord c = LangModel.GetWord(s);
+            s[i] = ch;
+            TWord c = LangModel.GetWord(TWord(s, len + 1));
             if (c.Ptr && c.Len) {
                 result.push_back(c);
             }
@@ -390,108 +550,371 @@ void TSpellCorrector::Inserts(const std::wstring& w, TWords& result) const {
     }
 }
 
-void TSpellCorrector::Inserts2(const std::wstring& w, TWords& result) const {
-    for (size_t i = 0; i < w.size() + 1; ++i) {
-        for (auto&& ch: LangModel.GetAlphabet()) {
-            std::wstring s = w.substr(0, i) + ch + w.substr(i);
-            if (Deletes1->Contains(WideToUTF8(s))) {
-                Inserts(s, result);
+// Takes an alphabet coded word
+void TSpellCorrector::Inserts2(const char* w, size_t len, TWords& result) const {
+    const TAlphabetCodec& codec = LangModel.GetCodec();
+    std::string buffer(len + 1, 0);
+    char* s = &buffer[0];
+    std::wstring decoded;
+    for (size_t i = 0; i < len + 1; ++i) {
+        std::copy(w, w + i, s);
+        std::copy(w + i, w + len, s + i + 1);
+        for (size_t symbol = 1; symbol <= codec.LettersNumber(); ++symbol) {
+            s[i] = char(symbol);
+            if (Deletes1->Contains(s, len + 1)) {
+                codec.Decode(s, len + 1, decoded);
+                Inserts(decoded.data(), len + 1, result);
             }
         }
     }
 }
 
-void TSpellCorrector::PrepareCache() {
-    auto&& wordToId = LangModel.GetWordToId();
-    size_t n = 0;
-    size_t s = 0;
-    for (auto&& it: wordToId) {
-        n += 1;
-        s += it.first.size();
-        if (n > 3000) {
-            break;
+constexpr uint64_t SPELL_CHECKER_CACHE_MAGIC_BYTE = 3811558393781437494L;
+constexpr uint16_t SPELL_CHECKER_CACHE_VERSION = 5; // xor filters
+constexpr uint16_t SPELL_CHECKER_CACHE_MIN_VERSION = 3; // alphabet coded deletes in classic bloom filters
+
+constexpr uint32_t SPELL_CHECKER_CACHE_SECTION_META = 1;
+constexpr uint32_t SPELL_CHECKER_CACHE_SECTION_DELETES1 = 2;
+constexpr uint32_t SPELL_CHECKER_CACHE_SECTION_DELETES2 = 3;
+
+// Small vocabularies aren't split between threads
+constexpr size_t SPELL_CHECKER_CACHE_MIN_WORDS_PER_THREAD = 2000;
+constexpr size_t SPELL_CHECKER_CACHE_FALSE_POSITIVE_PROBES = 100000;
+
+// Empty filter for LoadParams, or a new one for given number of elements
+static std::unique_ptr<TStringFilter> CreateDeletesFilter(uint16_t type, uint64_t elements = 0,
+                                                          double falsePositiveRate = 0)
+{
+    std::unique_ptr<TStringFilter> filter;
+    if (type == DF_BLOOM) {
+        filter.reset(elements ? new TBloomFilter(elements, falsePositiveRate) : new TBloomFilter());
+    } else if (type == DF_BLOCKED_BLOOM) {
+        filter.reset(elements ? new TBlockedBloomFilter(elements, falsePositiveRate) : new TBlockedBloomFilter());
+    } else if (type == DF_XOR) {
+        filter.reset(elements ? new TXorFilter(falsePositiveRate) : new TXorFilter());
+    }
+    return filter;
+}
+
+static uint64_t DeletesFilterSize(uint16_t type, uint64_t elements, double falsePositiveRate) {
+    if (type == DF_BLOOM) {
+        return TBloomFilter::TableSizeFor(elements, falsePositiveRate);
+    } else if (type == DF_BLOCKED_BLOOM) {
+        return TBlockedBloomFilter::TableSizeFor(elements, falsePositiveRate);
+    } else if (type == DF_XOR) {
+        return TXorFilter::TableSizeFor(elements, falsePositiveRate);
+    }
+    return 0;
+}
+
+// Calls callback(ptr, len, level) for alphabet coded deletes of words [begin, end)
+template<typename TCallback>
+static void ForEachCodedDelete(const TLangModel& model, TWordId begin, TWordId end, TCallback&& callback) {
+    std::string coded;
+    for (TWordId wid = begin; wid < end; ++wid) {
+        TWord word = model.GetWordById(wid);
+        model.GetCodec().Encode(word.Ptr, word.Len, coded);
+        ForEachDelete2(coded.data(), coded.size(), callback);
+    }
+}
+
+// Number of distinct values in sorted unique parts
+static uint64_t CountDistinct(const std::vector<std::vector<uint64_t>>& parts) {
+    typedef std::pair<uint64_t, size_t> THead; // value, part
+    std::priority_queue<THead, std::vector<THead>, std::greater<THead>> heads;
+    std::vector<size_t> positions(parts.size(), 0);
+    for (size_t part = 0; part < parts.size(); ++part) {
+        if (!parts[part].empty()) {
+            heads.push(THead(parts[part][0], part));
         }
     }
-    size_t avgWordLen = std::max(int(double(s) / n) + 1, 1);
-    size_t avgWordLenMinusOne = std::max(size_t(1), avgWordLen - 1);
+    uint64_t distinct = 0;
+    bool first = true;
+    uint64_t last = 0;
+    while (!heads.empty()) {
+        THead head = heads.top();
+        heads.pop();
+        if (first || head.first != last) {
+            distinct += 1;
+            last = head.first;
+            first = false;
+        }
+        size_t& pos = positions[head.second];
+        if (++pos < parts[head.second].size()) {
+            heads.push(THead(parts[head.second][pos], head.second));
+        }
+    }
+    return distinct;
+}
 
-    uint64_t deletes1size = wordToId.size() * avgWordLen;
-    uint64_t deletes2size = wordToId.size() * avgWordLen * avgWordLenMinusOne;
-    deletes1size = std::max(uint64_t(1000), deletes1size);
-    deletes1size = std::max(uint64_t(1000), deletes1size);
+std::string TSpellCorrector::GetCacheFile(const std::string& modelFile) const {
+    if (CandidatesEngine == CE_DELETES_INDEX) {
+        return modelFile + ".deletes";
+    }
+    if (CandidatesEngine == CE_DAWG) {
+        return modelFile + ".dawg";
+    }
+    return modelFile + ".spell";
+}
 
-    double falsePositiveProb = 0.001;
-    Deletes1.reset(new TBloomFilter(deletes1size, falsePositiveProb));
-    Deletes2.reset(new TBloomFilter(deletes2size, falsePositiveProb));
+std::string TSpellCorrector::GetCandidatesTableFile(const std::string& modelFile) const {
+    return modelFile + ".candidates";
+}
 
-    uint64_t deletes1real = 0;
-    uint64_t deletes2real = 0;
+bool TSpellCorrector::PrepareCache() {
+    Deletes1.reset();
+    Deletes2.reset();
+    DeletesIndex.reset();
+    Dawg.reset();
+    CacheFile.reset();
+    if (CandidatesEngine == CE_DAWG) {
+        Dawg.reset(new TDawg());
+        Dawg->Build(LangModel);
+        std::cerr << "[info] dawg size: " << Dawg->MemoryUsage() / 1024 << "Kb" << std::endl;
+        return true;
+    }
+    if (CandidatesEngine == CE_DELETES_INDEX) {
+        DeletesIndex.reset(new TDeletesIndex());
+        DeletesIndex->Build(LangModel);
+        std::cerr << "[info] deletes index size: " << DeletesIndex->MemoryUsage() / 1024 << "Kb" << std::endl;
+        return true;
+    }
+
+    TWordId wordsNumber = LangModel.GetWordsNumber();
+    size_t threadsNumber = CacheThreads ? CacheThreads : std::max(std::thread::hardware_concurrency(), 1u);
+    threadsNumber = std::min(threadsNumber, wordsNumber / SPELL_CHECKER_CACHE_MIN_WORDS_PER_THREAD);
+    threadsNumber = std::max(threadsNumber, size_t(1));
+
+    auto partBegin = [&](size_t part) {
+        return TWordId(uint64_t(wordsNumber) * part / threadsNumber);
+    };
+
+    // Exact number of distinct deletes, by hashes (as filters see them)
+    std::vector<std::vector<uint64_t>> hashes1(threadsNumber);
+    std::vector<std::vector<uint64_t>> hashes2(threadsNumber);
+    RunParts(threadsNumber, [&](size_t part) {
+        ForEachCodedDelete(LangModel, partBegin(part), partBegin(part + 1), [&](const char* ptr, size_t len, int level) {
+            (level == 1 ? hashes1 : hashes2)[part].push_back(CityHash64(ptr, len));
+        });
+        for (auto* hashes: {&hashes1[part], &hashes2[part]}) {
+            std::sort(hashes->begin(), hashes->end());
+            hashes->erase(std::unique(hashes->begin(), hashes->end()), hashes->end());
+        }
+    });
+    uint64_t deletes1size = std::max<uint64_t>(CountDistinct(hashes1), 1);
+    uint64_t deletes2size = std::max<uint64_t>(CountDistinct(hashes2), 1);
+    std::vector<std::vector<uint64_t>>().swap(hashes1);
+    std::vector<std::vector<uint64_t>>().swap(hashes2);
+
+    std::vector<EDeletesFilter> filters = {DeletesFilter};
+    if (DeletesFilter != DF_BLOCKED_BLOOM) {
+        filters.push_back(DF_BLOCKED_BLOOM);
+    }
+    for (EDeletesFilter filter: filters) {
+        double falsePositiveRate = DeletesFalsePositiveRate;
+        auto cacheSize = [&](double rate) {
+            return DeletesFilterSize(filter, deletes1size, rate) + DeletesFilterSize(filter, deletes2size, rate);
+        };
+        if (DeletesCacheMaxSize) {
+            while (cacheSize(falsePositiveRate) > DeletesCacheMaxSize &&
+                   falsePositiveRate < SPELL_CHECKER_CACHE_MAX_FALSE_POSITIVE_RATE)
+            {
+                falsePositiveRate = std::min(falsePositiveRate * 1.1, SPELL_CHECKER_CACHE_MAX_FALSE_POSITIVE_RATE);
+            }
+            if (cacheSize(falsePositiveRate) > DeletesCacheMaxSize) {
+                std::cerr << "[error] deletes filters of type " << filter << " don't fit " << DeletesCacheMaxSize
+                          << " bytes even with false positive rate " << falsePositiveRate << std::endl;
+                continue;
+            }
+        }
 
-    for (auto&& it: wordToId) {
-        auto deletes = GetDeletes2(it.first);
-        for (auto&& w1: deletes) {
-            Deletes1->Insert(WideToUTF8(w1.back()));
-            deletes1real += 1;
-            for (size_t i = 0; i < w1.size() - 1; ++i) {
-                Deletes2->Insert(WideToUTF8(w1[i]));
-                deletes2real += 1;
+        // Threads insert deletes of their ranges of words into a pair of shared
+        // filters; filters without concurrent inserts (xor, which only collects
+        // hashes) are filled per thread and merged.
+        std::vector<std::unique_ptr<TStringFilter>> deletes1(threadsNumber);
+        std::vector<std::unique_ptr<TStringFilter>> deletes2(threadsNumber);
+        deletes1[0] = CreateDeletesFilter(filter, deletes1size, falsePositiveRate);
+        deletes2[0] = CreateDeletesFilter(filter, deletes2size, falsePositiveRate);
+        bool shared = deletes1[0]->ConcurrentInsert() && deletes2[0]->ConcurrentInsert();
+        bool concurrent = shared && threadsNumber > 1;
+        RunParts(threadsNumber, [&](size_t part) {
+            size_t own = shared ? 0 : part;
+            if (own) {
+                deletes1[own] = CreateDeletesFilter(filter, deletes1size, falsePositiveRate);
+                deletes2[own] = CreateDeletesFilter(filter, deletes2size, falsePositiveRate);
             }
+            TStringFilter& filter1 = *deletes1[own];
+            TStringFilter& filter2 = *deletes2[own];
+            ForEachCodedDelete(LangModel, partBegin(part), partBegin(part + 1), [&](const char* ptr, size_t len, int level) {
+                TStringFilter& target = level == 1 ? filter1 : filter2;
+                if (concurrent) {
+                    target.InsertConcurrent(ptr, len);
+                } else {
+                    target.Insert(ptr, len);
+                }
+            });
+        });
+
+        bool merged = true;
+        for (size_t part = 1; part < threadsNumber && !shared && merged; ++part) {
+            merged = deletes1[0]->Merge(*deletes1[part]) && deletes2[0]->Merge(*deletes2[part]);
+            deletes1[part].reset();
+            deletes2[part].reset();
+        }
+        Deletes1 = std::move(deletes1[0]);
+        Deletes2 = std::move(deletes2[0]);
+        if (!merged) {
+            std::cerr << "[error] failed to merge deletes filters of type " << filter << std::endl;
+            continue;
         }
+        // Static filters are built by Finish, the two can be built together
+        bool finished1 = true;
+        std::thread finish1;
+        if (threadsNumber > 1) {
+            finish1 = std::thread([&]() { finished1 = Deletes1->Finish(); });
+        } else {
+            finished1 = Deletes1->Finish();
+        }
+        bool finished2 = Deletes2->Finish();
+        if (finish1.joinable()) {
+            finish1.join();
+        }
+        if (finished1 && finished2) {
+            LoadedDeletesFilter = filter;
+            LogDeletesFilter("deletes1", *Deletes1, deletes1size, falsePositiveRate);
+            LogDeletesFilter("deletes2", *Deletes2, deletes2size, falsePositiveRate);
+            return true;
+        }
+        std::cerr << "[error] failed to build deletes filters of type " << filter << std::endl;
     }
+    Deletes1.reset();
+    Deletes2.reset();
+    return false;
 }
 
-constexpr uint64_t SPELL_CHECKER_CACHE_MAGIC_BYTE = 3811558393781437494L;
-constexpr uint16_t SPELL_CHECKER_CACHE_VERSION = 1;
+// Logs filter size and false positive rate measured on strings that can't be
+// inserted: coded words never contain 0 (unknown letter).
+void TSpellCorrector::LogDeletesFilter(const std::string& name, const TStringFilter& filter,
+                                       uint64_t elements, double falsePositiveRate) const
+{
+    size_t probes = 0;
+    size_t positives = 0;
+    std::string coded;
+    for (TWordId wid = 0; wid < LangModel.GetWordsNumber() && probes < SPELL_CHECKER_CACHE_FALSE_POSITIVE_PROBES; ++wid) {
+        TWord word = LangModel.GetWordById(wid);
+        LangModel.GetCodec().Encode(word.Ptr, word.Len, coded);
+        for (size_t i = 0; i <= word.Len && probes < SPELL_CHECKER_CACHE_FALSE_POSITIVE_PROBES; ++i) {
+            std::string probe = coded;
+            probe.insert(i, 1, '\0');
+            probes += 1;
+            positives += filter.Contains(probe.data(), probe.size());
+        }
+    }
+    std::cerr << "[info] " << name << ": " << elements << " keys, "
+              << double(filter.TableSize()) * 8 / elements << " bits/key, false positive rate "
+              << double(positives) / std::max(probes, size_t(1)) << " (target " << falsePositiveRate << ")" << std::endl;
+}
 
 bool TSpellCorrector::LoadCache(const std::string& cacheFile) {
-    std::ifstream in(cacheFile, std::ios::binary);
-    if (!in.is_open()) {
-        return false;
+    if (CandidatesEngine == CE_DELETES_INDEX) {
+        std::unique_ptr<TDeletesIndex> index(new TDeletesIndex());
+        if (!index->Load(cacheFile, LangModel)) {
+            return false;
+        }
+        Deletes1.reset();
+        Deletes2.reset();
+        CacheFile.reset();
+        Dawg.reset();
+        DeletesIndex = std::move(index);
+        return true;
     }
-    uint16_t version = 0;
-    uint64_t magicByte = 0;
-    NHandyPack::Load(in, magicByte);
-    if (magicByte != SPELL_CHECKER_CACHE_MAGIC_BYTE) {
+    if (CandidatesEngine == CE_DAWG) {
+        std::unique_ptr<TDawg> dawg(new TDawg());
+        if (!dawg->Load(cacheFile, LangModel.GetCheckSum())) {
+            return false;
+        }
+        Deletes1.reset();
+        Deletes2.reset();
+        CacheFile.reset();
+        DeletesIndex.reset();
+        Dawg = std::move(dawg);
+        return true;
+    }
+    std::unique_ptr<TMappedSections> file(new TMappedSections());
+    if (!file->Open(cacheFile, SPELL_CHECKER_CACHE_MAGIC_BYTE,
+                    SPELL_CHECKER_CACHE_MIN_VERSION, SPELL_CHECKER_CACHE_VERSION))
+    {
         return false;
     }
-    NHandyPack::Load(in, version);
-    if (version != SPELL_CHECKER_CACHE_VERSION) {
+    const char* meta = nullptr;
+    size_t metaSize = 0;
+    if (!file->Get(SPELL_CHECKER_CACHE_SECTION_META, meta, metaSize)) {
         return false;
     }
+    NHandyPack::imemstream in(meta, metaSize);
     uint64_t checkSum = 0;
     NHandyPack::Load(in, checkSum);
     if (checkSum != LangModel.GetCheckSum()) {
         return false;
     }
-    std::unique_ptr<TBloomFilter> deletes1(new TBloomFilter());
-    std::unique_ptr<TBloomFilter> deletes2(new TBloomFilter());
-    deletes1->Load(in);
-    deletes2->Load(in);
-    magicByte = 0;
-    NHandyPack::Load(in, magicByte);
-    if (magicByte != SPELL_CHECKER_CACHE_MAGIC_BYTE) {
+    uint16_t filterType = DF_BLOOM;
+    if (file->GetVersion() >= 4) {
+        NHandyPack::Load(in, filterType);
+    }
+    std::unique_ptr<TStringFilter> deletes1 = CreateDeletesFilter(filterType);
+    std::unique_ptr<TStringFilter> deletes2 = CreateDeletesFilter(filterType);
+    if (!deletes1 || !deletes2) {
+        return false;
+    }
+    deletes1->LoadParams(in);
+    deletes2->LoadParams(in);
+    if (!in) {
         return false;
     }
+    const char* table1 = nullptr;
+    const char* table2 = nullptr;
+    size_t table1Size = 0;
+    size_t table2Size = 0;
+    if (!file->Get(SPELL_CHECKER_CACHE_SECTION_DELETES1, table1, table1Size) ||
+        !file->Get(SPELL_CHECKER_CACHE_SECTION_DELETES2, table2, table2Size) ||
+        table1Size != deletes1->TableSize() ||
+        table2Size != deletes2->TableSize())
+    {
+        return false;
+    }
+    deletes1->SetTable(table1);
+    deletes2->SetTable(table2);
     Deletes1 = std::move(deletes1);
     Deletes2 = std::move(deletes2);
+    LoadedDeletesFilter = EDeletesFilter(filterType);
+    CacheFile = std::move(file);
+    DeletesIndex.reset();
+    Dawg.reset();
     return true;
 }
 
 bool TSpellCorrector::SaveCache(const std::string& cacheFile) {
-    std::ofstream out(cacheFile, std::ios::binary);
-    if (!out.is_open()) {
-        return false;
+    if (CandidatesEngine == CE_DELETES_INDEX) {
+        return DeletesIndex && DeletesIndex->Dump(cacheFile, LangModel.GetCheckSum());
+    }
+    if (CandidatesEngine == CE_DAWG) {
+        return Dawg && Dawg->Dump(cacheFile, LangModel.GetCheckSum());
     }
     if (!Deletes1 || !Deletes2) {
         return false;
     }
-    NHandyPack::Dump(out, SPELL_CHECKER_CACHE_MAGIC_BYTE);
-    NHandyPack::Dump(out, SPELL_CHECKER_CACHE_VERSION);
-    NHandyPack::Dump(out, LangModel.GetCheckSum());
-    Deletes1->Dump(out);
-    Deletes2->Dump(out);
-    NHandyPack::Dump(out, SPELL_CHECKER_CACHE_MAGIC_BYTE);
-    return true;
+    std::stringbuf metaBuf;
+    std::ostream meta(&metaBuf);
+    uint16_t filterType = LoadedDeletesFilter;
+    NHandyPack::Dump(meta, LangModel.GetCheckSum(), filterType);
+    Deletes1->DumpParams(meta);
+    Deletes2->DumpParams(meta);
+
+    TSectionsWriter writer;
+    writer.Add(SPELL_CHECKER_CACHE_SECTION_META, metaBuf.str());
+    writer.Add(SPELL_CHECKER_CACHE_SECTION_DELETES1, Deletes1->TableData(), Deletes1->TableSize());
+    writer.Add(SPELL_CHECKER_CACHE_SECTION_DELETES2, Deletes2->TableData(), Deletes2->TableSize());
+    return writer.Write(cacheFile, SPELL_CHECKER_CACHE_MAGIC_BYTE, SPELL_CHECKER_CACHE_VERSION);
 }
 
 
@@ -4,10 +4,30 @@
 
 #include "lang_model.hpp"
 #include "bloom_filter.hpp"
+#include "xor_filter.hpp"
+#include "deletes_index.hpp"
+#include "dawg.hpp"
+#include "lru_cache.hpp"
+#include "candidates_table.hpp"
 
 namespace NJamSpell {
 
+// How candidates are found
+enum ECandidatesEngine {
+    CE_DELETES_BLOOM = 0, // generate deletes and inserts, prune with bloom filters of deletes (.spell cache)
+    CE_DELETES_INDEX = 1, // look up deletes in a delete variant -> words index (.deletes cache)
+    CE_DAWG = 2,          // walk the vocabulary automaton within edit distance 1, then 2 (.dawg cache)
+};
+
+// Filters of word deletes used by CE_DELETES_BLOOM, stored in the .spell cache
+enum EDeletesFilter {
+    DF_BLOOM = 0,         // classic bloom filter
+    DF_BLOCKED_BLOOM = 1, // one cache line per key
+    DF_XOR = 2,           // static xor filter, smaller, three reads per key
+};
 
+// Const methods don't modify the corrector and may be called from many threads
+// on a single loaded instance.
 class TSpellCorrector {
 public:
     bool LoadLangModel(const std::string& modelFile);
@@ -21,23 +41,66 @@ public:
     std::wstring FixFragmentNormalized(const std::wstring& text) const;
     void SetPenalty(double knownWordsPenalty, double unknownWordsPenalty);
     void SetMaxCandidatesToCheck(size_t maxCandidatesToCheck);
+    // Should be called before loading or training a model
+    void SetCandidatesEngine(ECandidatesEngine engine);
+    // Used when the .spell cache is built, an existing cache is loaded with its own filter
+    void SetDeletesFilter(EDeletesFilter filter);
+    // Threads used to build the .spell cache, 0 - all cores
+    void SetCacheThreads(size_t threads);
+    // Threads used to train a model, 0 - all cores
+    void SetTrainThreads(size_t threads);
+    // Target false positive rate of the .spell filters and the limit of their
+    // total size in bytes (0 - no limit); the rate is raised to fit the limit.
+    // If even rate 0.5 doesn't fit, loading or training the model fails.
+    // Rates outside (0, 0.5] are rejected and the limits are left unchanged.
+    bool SetDeletesCacheLimits(double falsePositiveRate, uint64_t maxSize = 0);
+    // Memoizes candidates of up to maxWords words before context scoring
+    // (0 - disabled); it's cleared when a model is loaded or trained
+    void SetCandidatesCacheSize(size_t maxWords);
+    NJamSpell::TLruCacheStats GetCandidatesCacheStats() const;
+    // Precomputes candidates of up to maxWords most frequent out of vocabulary
+    // (or any, with knownWords) words of a text, e.g. a query log, and saves
+    // them next to the model; instances that load this model use them
+    bool BuildCandidatesTable(const std::string& textFile, size_t maxWords, const std::string& modelFile,
+                              bool knownWords = false);
     const NJamSpell::TLangModel& GetLangModel() const;
 private:
+    NJamSpell::TWords GenerateCandidates(NJamSpell::TWord& word, bool& firstLevel, bool& knownWord) const;
+    NJamSpell::TWordCandidates GetCandidateIds(const NJamSpell::TWords& candidates, const NJamSpell::TWord& word,
+                                               bool firstLevel, bool knownWord) const;
     void FilterCandidatesByFrequency(std::unordered_set<NJamSpell::TWord, NJamSpell::TWordHashPtr>& uniqueCandidates, NJamSpell::TWord origWord) const;
     NJamSpell::TWords Edits(const NJamSpell::TWord& word) const;
     NJamSpell::TWords Edits2(const NJamSpell::TWord& word, bool lastLevel = true) const;
-    void Inserts(const std::wstring& w, NJamSpell::TWords& result) const;
-    void Inserts2(const std::wstring& w, NJamSpell::TWords& result) const;
-    void PrepareCache();
+    NJamSpell::TWords DawgCandidates(const NJamSpell::TWord& word, size_t maxDistance) const;
+    void Inserts(const wchar_t* w, size_t len, NJamSpell::TWords& result) const;
+    void Inserts2(const char* w, size_t len, NJamSpell::TWords& result) const;
+    std::string GetCacheFile(const std::string& modelFile) const;
+    std::string GetCandidatesTableFile(const std::string& modelFile) const;
+    bool PrepareCache();
+    void LogDeletesFilter(const std::string& name, const NJamSpell::TStringFilter& filter,
+                          uint64_t elements, double falsePositiveRate) const;
     bool LoadCache(const std::string& cacheFile);
     bool SaveCache(const std::string& cacheFile);
 private:
     TLangModel LangModel;
-    std::unique_ptr<TBloomFilter> Deletes1;
-    std::unique_ptr<TBloomFilter> Deletes2;
+    std::unique_ptr<TStringFilter> Deletes1;
+    std::unique_ptr<TStringFilter> Deletes2;
+    EDeletesFilter DeletesFilter = DF_BLOCKED_BLOOM;
+    EDeletesFilter LoadedDeletesFilter = DF_BLOCKED_BLOOM;
+    size_t CacheThreads = 0;
+    double DeletesFalsePositiveRate = 0.001;
+    uint64_t DeletesCacheMaxSize = 0;
+    std::unique_ptr<TMappedSections> CacheFile;
+    std::unique_ptr<TDeletesIndex> DeletesIndex;
+    std::unique_ptr<TDawg> Dawg;
+    ECandidatesEngine CandidatesEngine = CE_DELETES_BLOOM;
     double KnownWordsPenalty = 20.0;
     double UnknownWordsPenalty = 5.0;
     size_t MaxCandidatesToCheck = 14;
+
+    typedef TLruCache<std::wstring, TWordCandidates> TCandidatesCache;
+    std::unique_ptr<TCandidatesCache> CandidatesCache;
+    std::unique_ptr<TCandidatesTable> CandidatesTable;
 };
 
 
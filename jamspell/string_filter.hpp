@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+#include <iosfwd>
+
+namespace NJamSpell {
+
+// Set of strings that may answer false positives but no false negatives.
+// Parameters and table are stored separately, for memory mapped caches:
+// after LoadParams the table must be provided with SetTable, it is used in
+// place and should outlive the filter.
+class TStringFilter {
+public:
+    virtual ~TStringFilter() {}
+    virtual void Insert(const char* data, size_t size) = 0;
+    // Filters that return true here can be filled by several threads at once
+    // with InsertConcurrent; others are filled per thread and joined by Merge
+    virtual bool ConcurrentInsert() const {
+        return false;
+    }
+    virtual void InsertConcurrent(const char* data, size_t size) {
+        Insert(data, size);
+    }
+    // Adds elements of a filter of the same type and parameters, before Finish
+    virtual bool Merge(const TStringFilter& /*other*/) {
+        return false;
+    }
+    // Called once after all inserts, before lookups
+    virtual bool Finish() {
+        return true;
+    }
+    virtual bool Contains(const char* data, size_t size) const = 0;
+    virtual void DumpParams(std::ostream& out) const = 0;
+    virtual void LoadParams(std::istream& in) = 0;
+    virtual const char* TableData() const = 0;
+    virtual size_t TableSize() const = 0;
+    virtual void SetTable(const char* data) = 0;
+};
+
+} // NJamSpell
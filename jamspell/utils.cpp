@@ -108,6 +108,47 @@ const std::unordered_set<wchar_t>& TTokenizer::GetAlphabet() const {
     return Alphabet;
 }
 
+bool TAlphabetCodec::Init(const std::unordered_set<wchar_t>& alphabet) {
+    Clear();
+    if (alphabet.size() > std::numeric_limits<uint8_t>::max()) {
+        return false;
+    }
+    std::vector<wchar_t> letters(alphabet.begin(), alphabet.end());
+    std::sort(letters.begin(), letters.end(), [](wchar_t a, wchar_t b) {
+        return uint32_t(a) < uint32_t(b);
+    });
+    Letters.push_back(0);
+    Letters.insert(Letters.end(), letters.begin(), letters.end());
+    Symbols.assign(letters.empty() ? 0 : size_t(uint32_t(letters.back())) + 1, 0);
+    for (size_t i = 0; i < letters.size(); ++i) {
+        Symbols[uint32_t(letters[i])] = uint8_t(i + 1);
+    }
+    return true;
+}
+
+void TAlphabetCodec::Clear() {
+    Symbols.clear();
+    Letters.clear();
+}
+
+void TAlphabetCodec::Encode(const wchar_t* word, size_t len, std::string& result) const {
+    result.resize(len);
+    for (size_t i = 0; i < len; ++i) {
+        result[i] = char(Encode(word[i]));
+    }
+}
+
+void TAlphabetCodec::Decode(const char* word, size_t len, std::wstring& result) const {
+    result.resize(len);
+    for (size_t i = 0; i < len; ++i) {
+        result[i] = Decode(uint8_t(word[i]));
+    }
+}
+
+size_t TAlphabetCodec::LettersNumber() const {
+    return Letters.empty() ? 0 : Letters.size() - 1;
+}
+
 std::wstring UTF8ToWide(const std::string& text) {
 #ifdef USE_BOOST_CONVERT
     using boost::locale::conv::utf_to_utf;
@@ -129,6 +170,28 @@ std::string WideToUTF8(const std::wstring& text) {
 #endif
 }
 
+void WideToUTF8(const wchar_t* text, size_t size, std::string& result) {
+    result.clear();
+    for (size_t i = 0; i < size; ++i) {
+        uint32_t c = uint32_t(text[i]);
+        if (c < 0x80) {
+            result.push_back(char(c));
+        } else if (c < 0x800) {
+            result.push_back(char(0xC0 | (c >> 6)));
+            result.push_back(char(0x80 | (c & 0x3F)));
+        } else if (c < 0x10000) {
+            result.push_back(char(0xE0 | (c >> 12)));
+            result.push_back(char(0x80 | ((c >> 6) & 0x3F)));
+            result.push_back(char(0x80 | (c & 0x3F)));
+        } else {
+            result.push_back(char(0xF0 | (c >> 18)));
+            result.push_back(char(0x80 | ((c >> 12) & 0x3F)));
+            result.push_back(char(0x80 | ((c >> 6) & 0x3F)));
+            result.push_back(char(0x80 | (c & 0x3F)));
+        }
+    }
+}
+
 uint64_t GetCurrentTimeMs() {
     using namespace std::chrono;
     milliseconds ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch());
@@ -4,16 +4,26 @@
 #include <vector>
 #include <unordered_set>
 #include <locale>
+#include <limits>
+#include <thread>
 
 #include <contrib/handypack/handypack.hpp>
 
 namespace NJamSpell {
 
+using TWordId = uint32_t;
+
+constexpr TWordId UNKNOWN_WORD_ID = std::numeric_limits<TWordId>::max();
+constexpr TWordId UNRESOLVED_WORD_ID = UNKNOWN_WORD_ID - 1;
+
+// Words point to their text (input or model vocabulary) and may carry the
+// vocabulary id, so that it is looked up once per word and not per use.
 struct TWord {
     TWord() = default;
-    TWord(const wchar_t* ptr, size_t len)
+    TWord(const wchar_t* ptr, size_t len, TWordId id = UNRESOLVED_WORD_ID)
         : Ptr(ptr)
         , Len(len)
+        , Id(id)
     {
     }
     TWord(const std::wstring& w)
@@ -26,6 +36,7 @@ struct TWord {
     }
     const wchar_t* Ptr = nullptr;
     size_t Len = 0;
+    TWordId Id = UNRESOLVED_WORD_ID;
 };
 
 struct TScoredWord {
@@ -59,14 +70,58 @@ private:
     std::locale Locale;
 };
 
+// Maps letters of an alphabet to one byte symbols 1..255 in order of their
+// codes, 0 stands for any other character. Deletes and inserts are generated
+// and hashed on such compact strings instead of wide or UTF-8 ones.
+class TAlphabetCodec {
+public:
+    bool Init(const std::unordered_set<wchar_t>& alphabet); // false if there are more than 255 letters
+    void Clear();
+    uint8_t Encode(wchar_t letter) const {
+        size_t code = uint32_t(letter);
+        return code < Symbols.size() ? Symbols[code] : 0;
+    }
+    wchar_t Decode(uint8_t symbol) const {
+        return Letters[symbol];
+    }
+    void Encode(const wchar_t* word, size_t len, std::string& result) const;
+    void Decode(const char* word, size_t len, std::wstring& result) const;
+    size_t LettersNumber() const;
+private:
+    std::vector<uint8_t> Symbols; // letter code -> symbol
+    std::vector<wchar_t> Letters; // symbol -> letter, 0 for symbol 0
+};
+
 std::string LoadFile(const std::string& fileName);
 void SaveFile(const std::string& fileName, const std::string& data);
 std::wstring UTF8ToWide(const std::string& text);
 std::string WideToUTF8(const std::wstring& text);
+void WideToUTF8(const wchar_t* text, size_t size, std::string& result); // reuses result memory
 uint64_t GetCurrentTimeMs();
 void ToLower(std::wstring& text);
 wchar_t MakeUpperIfRequired(wchar_t orig, wchar_t sample);
 uint16_t CityHash16(const std::string& str);
 uint16_t CityHash16(const char* str, size_t size);
 
+// Calls func(part) for each of partsNumber parts, in parallel
+template<typename TFunc>
+void RunParts(size_t partsNumber, TFunc&& func) {
+    std::vector<std::thread> threads;
+    for (size_t part = 1; part < partsNumber; ++part) {
+        threads.emplace_back(func, part);
+    }
+    func(0);
+    for (auto&& t: threads) {
+        t.join();
+    }
+}
+
+inline void Prefetch(const void* ptr) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(ptr);
+#else
+    (void)ptr;
+#endif
+}
+
 } // NJamSpell
@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <cassert>
+
+#include "vocabulary.hpp"
+
+#include <contrib/cityhash/city.h>
+
+namespace NJamSpell {
+
+static const uint64_t EMPTY_SLOT = std::numeric_limits<uint64_t>::max();
+
+static inline uint64_t MakeSlot(uint64_t hash, TWordId wid) {
+    return (hash & 0xFFFFFFFF00000000ULL) | wid;
+}
+
+static inline TWordId SlotWordId(uint64_t slot) {
+    return TWordId(slot);
+}
+
+static inline bool SlotTagMatch(uint64_t slot, uint64_t hash) {
+    return (slot >> 32) == (hash >> 32);
+}
+
+uint64_t TVocabulary::Hash(const wchar_t* ptr, size_t len) {
+    return CityHash64((const char*)ptr, len * sizeof(wchar_t));
+}
+
+TWordId TVocabulary::Add(const wchar_t* ptr, size_t len) {
+    TWordId wid = Find(ptr, len);
+    if (wid != UNKNOWN_WORD_ID) {
+        return wid;
+    }
+    if (Offsets.empty()) {
+        Offsets.PushBack(0);
+    }
+    wid = Size();
+    assert(wid < UNRESOLVED_WORD_ID);
+    Pool.Append(ptr, ptr + len);
+    Offsets.PushBack(Pool.size());
+
+    // keep load factor under 3/4
+    if (4 * (size_t(wid) + 1) > 3 * Index.size()) {
+        Rehash(std::max(Index.size() * 2, size_t(16)));
+    } else {
+        uint64_t hash = Hash(ptr, len);
+        uint64_t* index = Index.MutableData();
+        size_t mask = Index.size() - 1;
+        size_t pos = hash & mask;
+        while (index[pos] != EMPTY_SLOT) {
+            pos = (pos + 1) & mask;
+        }
+        index[pos] = MakeSlot(hash, wid);
+    }
+    return wid;
+}
+
+void TVocabulary::Rehash(size_t indexSize) {
+    std::vector<uint64_t> index(indexSize, EMPTY_SLOT);
+    size_t mask = indexSize - 1;
+    for (TWordId wid = 0; wid < Size(); ++wid) {
+        TWord w = GetWord(wid);
+        uint64_t hash = Hash(w.Ptr, w.Len);
+        size_t pos = hash & mask;
+        while (index[pos] != EMPTY_SLOT) {
+            pos = (pos + 1) & mask;
+        }
+        index[pos] = MakeSlot(hash, wid);
+    }
+    Index.Assign(std::move(index));
+}
+
+TWordId TVocabulary::Find(const wchar_t* ptr, size_t len) const {
+    if (Index.empty()) {
+        return UNKNOWN_WORD_ID;
+    }
+    uint64_t hash = Hash(ptr, len);
+    size_t mask = Index.size() - 1;
+    size_t pos = hash & mask;
+    for (uint64_t slot = Index[pos]; slot != EMPTY_SLOT; slot = Index[pos]) {
+        if (SlotTagMatch(slot, hash)) {
+            TWordId wid = SlotWordId(slot);
+            uint32_t begin = Offsets[wid];
+            uint32_t end = Offsets[wid + 1];
+            if (end - begin == len && std::equal(ptr, ptr + len, Pool.data() + begin)) {
+                return wid;
+            }
+        }
+        pos = (pos + 1) & mask;
+    }
+    return UNKNOWN_WORD_ID;
+}
+
+TWord TVocabulary::GetWord(TWordId wid) const {
+    if (wid >= Size()) {
+        return TWord();
+    }
+    return TWord(Pool.data() + Offsets[wid], Offsets[wid + 1] - Offsets[wid], wid);
+}
+
+TWordId TVocabulary::Size() const {
+    return Offsets.empty() ? 0 : TWordId(Offsets.size() - 1);
+}
+
+size_t TVocabulary::MemoryUsage() const {
+    return Pool.MemoryUsage() + Offsets.MemoryUsage() + Index.MemoryUsage();
+}
+
+void TVocabulary::Clear() {
+    Pool.Clear();
+    Offsets.Clear();
+    Index.Clear();
+}
+
+void TVocabulary::Dump(TSectionsWriter& writer, uint32_t poolSection, uint32_t offsetsSection, uint32_t indexSection) const {
+    writer.Add(poolSection, Pool);
+    writer.Add(offsetsSection, Offsets);
+    writer.Add(indexSection, Index);
+}
+
+bool TVocabulary::Load(const TMappedSections& file, uint32_t poolSection, uint32_t offsetsSection, uint32_t indexSection) {
+    Clear();
+    if (!file.Get(poolSection, Pool) ||
+        !file.Get(offsetsSection, Offsets) ||
+        !file.Get(indexSection, Index))
+    {
+        Clear();
+        return false;
+    }
+    bool indexSizeValid = (Index.size() & (Index.size() - 1)) == 0;
+    bool offsetsValid = Offsets.empty() || Offsets[Offsets.size() - 1] == Pool.size();
+    if (!indexSizeValid || !offsetsValid) {
+        Clear();
+        return false;
+    }
+    return true;
+}
+
+} // NJamSpell
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "utils.hpp"
+#include "mapped_file.hpp"
+
+namespace NJamSpell {
+
+// Flat word <-> id store. Words are kept in one contiguous pool in id order,
+// the string -> id index is an open addressing table of 64-bit slots
+// (32-bit hash tag, 32-bit word id) probed linearly, so a lookup touches a
+// single index cache line and compares strings only on a tag match.
+// All arrays can be mapped from a model file and used in place.
+class TVocabulary {
+public:
+    TWordId Add(const wchar_t* ptr, size_t len); // returns existing id for known words
+    TWordId Find(const wchar_t* ptr, size_t len) const;
+    TWord GetWord(TWordId wid) const;
+    TWordId Size() const;
+    size_t MemoryUsage() const;
+    void Clear();
+
+    void Dump(TSectionsWriter& writer, uint32_t poolSection, uint32_t offsetsSection, uint32_t indexSection) const;
+    bool Load(const TMappedSections& file, uint32_t poolSection, uint32_t offsetsSection, uint32_t indexSection);
+private:
+    void Rehash(size_t indexSize);
+    static uint64_t Hash(const wchar_t* ptr, size_t len);
+private:
+    TFlatArray<wchar_t> Pool;       // all words, concatenated in id order
+    TFlatArray<uint32_t> Offsets;   // word id -> offset in Pool, Size() + 1 items
+    TFlatArray<uint64_t> Index;     // power of two sized, all bits set in empty slots
+};
+
+} // NJamSpell
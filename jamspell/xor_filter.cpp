@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <istream>
+#include <limits>
+
+#include <contrib/cityhash/city.h>
+#include <contrib/handypack/handypack.hpp>
+
+#include "xor_filter.hpp"
+#include "gram_key.hpp"
+
+namespace NJamSpell {
+
+constexpr uint32_t XOR_FILTER_MAX_FINGERPRINT_BITS = 32;
+constexpr double XOR_FILTER_SIZE_FACTOR = 1.23; // slots per key, peeling fails below ~1.22
+constexpr uint32_t XOR_FILTER_EXTRA_SLOTS = 32;
+constexpr uint32_t XOR_FILTER_MAX_ATTEMPTS = 100;
+
+static uint64_t LowBitsMask(uint32_t bits) {
+    return bits >= 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1;
+}
+
+static uint32_t Reduce(uint32_t hash, uint32_t n) {
+    return uint32_t((uint64_t(hash) * n) >> 32);
+}
+
+static uint64_t RotateLeft(uint64_t value, uint32_t shift) {
+    return (value << shift) | (value >> (64 - shift));
+}
+
+static uint32_t XorFingerprintBits(double falsePositiveRate) {
+    assert(falsePositiveRate > 0.0 && falsePositiveRate < 1.0);
+    double bits = std::ceil(-std::log2(falsePositiveRate));
+    return uint32_t(std::min<double>(std::max(1.0, bits), XOR_FILTER_MAX_FINGERPRINT_BITS));
+}
+
+static uint64_t XorSegmentLength(uint64_t elements) {
+    return (uint64_t(XOR_FILTER_SIZE_FACTOR * elements) + XOR_FILTER_EXTRA_SLOTS + 2) / 3;
+}
+
+TXorFilter::TXorFilter(double falsePositiveRate) {
+    FingerprintBits = XorFingerprintBits(falsePositiveRate);
+}
+
+uint64_t TXorFilter::TableSizeFor(uint64_t elements, double falsePositiveRate) {
+    uint64_t bits = XorSegmentLength(elements) * 3 * XorFingerprintBits(falsePositiveRate);
+    return ((bits + 63) / 64 + 1) * sizeof(uint64_t);
+}
+
+void TXorFilter::Insert(const char* data, size_t size) {
+    assert(Table == nullptr && "Filter is already built");
+    Hashes.push_back(CityHash64(data, size));
+}
+
+bool TXorFilter::Merge(const TStringFilter& other) {
+    const TXorFilter* filter = dynamic_cast<const TXorFilter*>(&other);
+    if (!filter || Table != nullptr || filter->Table != nullptr || FingerprintBits != filter->FingerprintBits) {
+        return false;
+    }
+    Hashes.insert(Hashes.end(), filter->Hashes.begin(), filter->Hashes.end());
+    return true;
+}
+
+uint64_t TXorFilter::SlotsHash(uint64_t hash) const {
+    return MixHash64(hash + Seed);
+}
+
+void TXorFilter::GetSlots(uint64_t slotsHash, uint32_t slots[3]) const {
+    slots[0] = Reduce(uint32_t(slotsHash), SegmentLength);
+    slots[1] = Reduce(uint32_t(RotateLeft(slotsHash, 21)), SegmentLength) + SegmentLength;
+    slots[2] = Reduce(uint32_t(RotateLeft(slotsHash, 42)), SegmentLength) + 2 * SegmentLength;
+}
+
+uint32_t TXorFilter::Fingerprint(uint64_t slotsHash) const {
+    return uint32_t((slotsHash ^ (slotsHash >> 32)) & LowBitsMask(FingerprintBits));
+}
+
+uint32_t TXorFilter::ReadSlot(uint32_t slot) const {
+    uint64_t bitPos = uint64_t(slot) * FingerprintBits;
+    uint64_t data;
+    memcpy(&data, (const char*)Table + bitPos / 8, sizeof(data));
+    return uint32_t((data >> (bitPos % 8)) & LowBitsMask(FingerprintBits));
+}
+
+void TXorFilter::WriteSlot(uint32_t slot, uint32_t value) {
+    uint64_t bitPos = uint64_t(slot) * FingerprintBits;
+    char* ptr = (char*)Storage.data() + bitPos / 8;
+    uint32_t shift = bitPos % 8;
+    uint64_t mask = LowBitsMask(FingerprintBits) << shift;
+    uint64_t data;
+    memcpy(&data, ptr, sizeof(data));
+    data = (data & ~mask) | (uint64_t(value) << shift);
+    memcpy(ptr, &data, sizeof(data));
+}
+
+size_t TXorFilter::TableWords() const {
+    uint64_t bits = uint64_t(SegmentLength) * 3 * FingerprintBits;
+    return (bits + 63) / 64 + 1; // spare word for unaligned reads
+}
+
+bool TXorFilter::Finish() {
+    std::vector<uint64_t> hashes;
+    hashes.swap(Hashes);
+    std::sort(hashes.begin(), hashes.end());
+    hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+    uint64_t segmentLength = XorSegmentLength(hashes.size());
+    if (segmentLength * 3 > std::numeric_limits<uint32_t>::max()) {
+        return false;
+    }
+    SegmentLength = uint32_t(segmentLength);
+    for (uint32_t attempt = 0; attempt < XOR_FILTER_MAX_ATTEMPTS; ++attempt) {
+        Seed = MixHash64(attempt + 1);
+        if (Build(hashes)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Peels keys off slots that only one key maps to; the keys are then
+// assigned in reverse order, each to the slot it was peeled from.
+bool TXorFilter::Build(const std::vector<uint64_t>& hashes) {
+    const uint32_t slotsNumber = 3 * SegmentLength;
+    std::vector<uint32_t> counts(slotsNumber, 0);
+    std::vector<uint64_t> xors(slotsNumber, 0);
+    uint32_t slots[3];
+    for (uint64_t hash: hashes) {
+        uint64_t h = SlotsHash(hash);
+        GetSlots(h, slots);
+        for (uint32_t slot: slots) {
+            counts[slot] += 1;
+            xors[slot] ^= h;
+        }
+    }
+
+    std::vector<uint32_t> queue;
+    for (uint32_t slot = 0; slot < slotsNumber; ++slot) {
+        if (counts[slot] == 1) {
+            queue.push_back(slot);
+        }
+    }
+    std::vector<std::pair<uint64_t, uint32_t>> peeled; // slots hash, slot
+    peeled.reserve(hashes.size());
+    while (!queue.empty()) {
+        uint32_t slot = queue.back();
+        queue.pop_back();
+        if (counts[slot] != 1) {
+            continue;
+        }
+        uint64_t h = xors[slot];
+        peeled.push_back(std::make_pair(h, slot));
+        GetSlots(h, slots);
+        for (uint32_t s: slots) {
+            counts[s] -= 1;
+            xors[s] ^= h;
+            if (counts[s] == 1) {
+                queue.push_back(s);
+            }
+        }
+    }
+    if (peeled.size() != hashes.size()) {
+        return false;
+    }
+
+    Storage.assign(TableWords(), 0);
+    Table = Storage.data();
+    for (auto it = peeled.rbegin(); it != peeled.rend(); ++it) {
+        GetSlots(it->first, slots);
+        uint32_t value = Fingerprint(it->first) ^ ReadSlot(slots[0]) ^ ReadSlot(slots[1]) ^ ReadSlot(slots[2]);
+        WriteSlot(it->second, value ^ ReadSlot(it->second));
+    }
+    return true;
+}
+
+bool TXorFilter::Contains(const char* data, size_t size) const {
+    if (Table == nullptr) {
+        return false;
+    }
+    uint64_t h = SlotsHash(CityHash64(data, size));
+    uint32_t slots[3];
+    GetSlots(h, slots);
+    return Fingerprint(h) == (ReadSlot(slots[0]) ^ ReadSlot(slots[1]) ^ ReadSlot(slots[2]));
+}
+
+void TXorFilter::DumpParams(std::ostream& out) const {
+    NHandyPack::Dump(out, FingerprintBits, Seed, SegmentLength);
+}
+
+void TXorFilter::LoadParams(std::istream& in) {
+    NHandyPack::Load(in, FingerprintBits, Seed, SegmentLength);
+    if (FingerprintBits > XOR_FILTER_MAX_FINGERPRINT_BITS) {
+        in.setstate(std::ios::failbit);
+    }
+    std::vector<uint64_t>().swap(Hashes);
+    std::vector<uint64_t>().swap(Storage);
+    Table = nullptr;
+}
+
+const char* TXorFilter::TableData() const {
+    return (const char*)Table;
+}
+
+size_t TXorFilter::TableSize() const {
+    return TableWords() * sizeof(uint64_t);
+}
+
+void TXorFilter::SetTable(const char* data) {
+    std::vector<uint64_t>().swap(Storage);
+    Table = (const uint64_t*)data;
+}
+
+} // NJamSpell
@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "string_filter.hpp"
+
+namespace NJamSpell {
+
+// Static xor filter (Graf, Lemire): each key maps to three slots, one in
+// each third of the table, whose fingerprints xor to the key fingerprint.
+// It takes about 1.23 * FingerprintBits bits per key for a false positive
+// rate of 2^-FingerprintBits, and a lookup always reads three slots.
+// Insert only collects key hashes, the table is built by Finish.
+class TXorFilter: public TStringFilter {
+public:
+    TXorFilter() = default;
+    explicit TXorFilter(double falsePositiveRate);
+    static uint64_t TableSizeFor(uint64_t elements, double falsePositiveRate);
+    void Insert(const char* data, size_t size) override;
+    bool Merge(const TStringFilter& other) override;
+    bool Finish() override;
+    bool Contains(const char* data, size_t size) const override;
+
+    void DumpParams(std::ostream& out) const override;
+    void LoadParams(std::istream& in) override;
+    const char* TableData() const override;
+    size_t TableSize() const override;
+    void SetTable(const char* data) override;
+private:
+    uint64_t SlotsHash(uint64_t hash) const;
+    void GetSlots(uint64_t slotsHash, uint32_t slots[3]) const;
+    uint32_t Fingerprint(uint64_t slotsHash) const;
+    uint32_t ReadSlot(uint32_t slot) const;
+    void WriteSlot(uint32_t slot, uint32_t value);
+    bool Build(const std::vector<uint64_t>& hashes);
+    size_t TableWords() const;
+private:
+    uint32_t FingerprintBits = 0;
+    uint64_t Seed = 0;
+    uint32_t SegmentLength = 0;
+    std::vector<uint64_t> Hashes; // collected by Insert
+    std::vector<uint64_t> Storage; // owned bit-packed fingerprints
+    const uint64_t* Table = nullptr;
+};
+
+} // NJamSpell
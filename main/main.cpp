@@ -1,4 +1,13 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <sstream>
+#include <thread>
 
 #include <jamspell/lang_model.hpp>
 #include <jamspell/spell_corrector.hpp>
@@ -7,18 +16,50 @@ using namespace NJamSpell;
 
 void PrintUsage(const char** argv) {
     std::cerr << "Usage: " << argv[0] << " mode args" << std::endl;
-    std::cerr << "    train alphabet.txt dataset.txt resultModel.bin  - train model" << std::endl;
+    std::cerr << "    train alphabet.txt dataset.txt resultModel.bin [layout] [memoryMb] [tempDir] - train model" << std::endl;
+    std::cerr << "        layout: bucket bits as fingerprint:count (8-24:6-16), for bigrams and trigrams (16:16)" << std::endl;
+    std::cerr << "        or for each of them separately (12:10,12:8)" << std::endl;
+    std::cerr << "        memoryMb: spill n-gram counts to tempDir (.) above it, 0 (default) - no limit" << std::endl;
     std::cerr << "    score model.bin - input sentences and get score" << std::endl;
     std::cerr << "    correct model.bin - input sentences and get corrected one" << std::endl;
-    std::cerr << "    fix model.bin input.txt output.txt - automatically fix txt file" << std::endl;
+    std::cerr << "    fix model.bin input.txt output.txt [engine] - automatically fix txt file" << std::endl;
+    std::cerr << "        engine: candidates lookup, bloom (default), xor (bloom engine with xor filters), index or dawg" << std::endl;
+    std::cerr << "    candidates model.bin text.txt [maxWords] [all] - precompute candidates of frequent unknown words of text" << std::endl;
+    std::cerr << "        maxWords: 100000 by default, all: include known words too" << std::endl;
+    std::cerr << "    bench model.bin input.txt [maxThreads] [cacheWords] - measure fix latency and throughput from 1 to maxThreads threads" << std::endl;
+    std::cerr << "        cacheWords: size of the candidates cache, 0 (default) - no cache" << std::endl;
+    std::cerr << "    bench-cache model.bin [maxThreads] - measure building of the .spell cache from 1 to maxThreads threads" << std::endl;
+    std::cerr << "    bench-train alphabet.txt dataset.txt [maxThreads] - measure training from 1 to maxThreads threads" << std::endl;
+}
+
+// Parses a decimal number up to maxValue, the whole string must be a number
+bool ParseNumber(const char* str, uint64_t maxValue, uint64_t& result) {
+    if (*str < '0' || *str > '9') {
+        return false;
+    }
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long value = std::strtoull(str, &end, 10);
+    if (errno != 0 || *end != 0 || value > maxValue) {
+        return false;
+    }
+    result = value;
+    return true;
 }
 
 int Train(const std::string& alphabetFile,
           const std::string& datasetFile,
-          const std::string& resultModelFile)
+          const std::string& resultModelFile,
+          const TBucketLayouts& layouts,
+          uint64_t memoryLimit,
+          const std::string& tempDir)
 {
     TLangModel model;
-    model.Train(datasetFile, alphabetFile);
+    model.SetTrainMemoryLimit(memoryLimit, tempDir);
+    if (!model.Train(datasetFile, alphabetFile, layouts)) {
+        std::cerr << "[error] failed to train model" << std::endl;
+        return 42;
+    }
     model.Dump(resultModelFile);
     return 0;
 }
@@ -42,9 +83,13 @@ int Score(const std::string& modelFile) {
 
 int Fix(const std::string& modelFile,
         const std::string& inputFile,
-        const std::string& outFile)
+        const std::string& outFile,
+        ECandidatesEngine engine,
+        EDeletesFilter filter)
 {
     TSpellCorrector corrector;
+    corrector.SetCandidatesEngine(engine);
+    corrector.SetDeletesFilter(filter);
     std::cerr << "[info] loading model" << std::endl;
     if (!corrector.LoadLangModel(modelFile)) {
         std::cerr << "[error] failed to load model" << std::endl;
@@ -60,6 +105,25 @@ int Fix(const std::string& modelFile,
     return 0;
 }
 
+int Candidates(const std::string& modelFile,
+               const std::string& textFile,
+               size_t maxWords,
+               bool knownWords)
+{
+    TSpellCorrector corrector;
+    std::cerr << "[info] loading model" << std::endl;
+    if (!corrector.LoadLangModel(modelFile)) {
+        std::cerr << "[error] failed to load model" << std::endl;
+        return 42;
+    }
+    std::cerr << "[info] loaded" << std::endl;
+    if (!corrector.BuildCandidatesTable(textFile, maxWords, modelFile, knownWords)) {
+        std::cerr << "[error] failed to build candidates" << std::endl;
+        return 42;
+    }
+    return 0;
+}
+
 int Correct(const std::string& modelFile) {
     TSpellCorrector corrector;
     std::cerr << "[info] loading model" << std::endl;
@@ -78,6 +142,174 @@ int Correct(const std::string& modelFile) {
     return 0;
 }
 
+int Bench(const std::string& modelFile,
+          const std::string& inputFile,
+          size_t maxThreads,
+          size_t cacheWords)
+{
+    TSpellCorrector corrector;
+    corrector.SetCandidatesCacheSize(cacheWords);
+    std::cerr << "[info] loading model" << std::endl;
+    if (!corrector.LoadLangModel(modelFile)) {
+        std::cerr << "[error] failed to load model" << std::endl;
+        return 42;
+    }
+    std::cerr << "[info] loaded" << std::endl;
+
+    std::vector<std::wstring> lines;
+    size_t wordsNumber = 0;
+    {
+        std::istringstream in(LoadFile(inputFile));
+        for (std::string line; std::getline(in, line);) {
+            if (line.empty()) {
+                continue;
+            }
+            std::wstring wline = UTF8ToWide(line);
+            for (auto&& s: corrector.GetLangModel().Tokenize(wline)) {
+                wordsNumber += s.size();
+            }
+            lines.push_back(wline);
+        }
+    }
+    if (lines.empty()) {
+        std::cerr << "[error] no input" << std::endl;
+        return 42;
+    }
+
+    {
+        // Score alone, over all tokenized sentences of the input
+        const TLangModel& model = corrector.GetLangModel();
+        std::vector<TWords> sentences;
+        for (auto&& line: lines) {
+            for (auto&& s: model.Tokenize(line)) {
+                sentences.push_back(s);
+            }
+        }
+        constexpr size_t SCORE_ITERATIONS = 20;
+        double checkSum = 0;
+        uint64_t startTime = GetCurrentTimeMs();
+        for (size_t i = 0; i < SCORE_ITERATIONS; ++i) {
+            for (auto&& s: sentences) {
+                checkSum += model.Score(s);
+            }
+        }
+        uint64_t elapsed = std::max<uint64_t>(GetCurrentTimeMs() - startTime, 1);
+        std::cout << "score: " << sentences.size() * SCORE_ITERATIONS << " calls"
+                  << ", " << 1000000.0 * elapsed / (sentences.size() * SCORE_ITERATIONS) << "ns/call"
+                  << ", " << 1000000.0 * elapsed / (wordsNumber * SCORE_ITERATIONS) << "ns/word"
+                  << " (checksum " << checkSum << ")" << std::endl;
+    }
+
+    {
+        // Latency of single lines, in input order: the cache (if any) starts empty
+        std::vector<double> latencies;
+        for (auto&& line: lines) {
+            auto startTime = std::chrono::steady_clock::now();
+            corrector.FixFragment(line);
+            latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - startTime).count());
+        }
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) {
+            return latencies[std::min(latencies.size() - 1, size_t(p * latencies.size()))];
+        };
+        std::cout << "latency per line: p50 " << percentile(0.5) << "us"
+                  << ", p90 " << percentile(0.9) << "us"
+                  << ", p99 " << percentile(0.99) << "us" << std::endl;
+        if (cacheWords) {
+            TLruCacheStats stats = corrector.GetCandidatesCacheStats();
+            std::cout << "candidates cache: " << stats.Hits << " hits, " << stats.Misses << " misses, "
+                      << stats.Evictions << " evictions, " << stats.Size << " words" << std::endl;
+        }
+    }
+
+    // Every thread fixes the whole input, so the ideal scaling keeps
+    // the time constant while words/s grows linearly.
+    double singleThreadSpeed = 0;
+    for (size_t threadsNumber = 1; threadsNumber <= maxThreads; ++threadsNumber) {
+        uint64_t startTime = GetCurrentTimeMs();
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < threadsNumber; ++t) {
+            threads.emplace_back([&corrector, &lines]() {
+                for (auto&& line: lines) {
+                    corrector.FixFragment(line);
+                }
+            });
+        }
+        for (auto&& t: threads) {
+            t.join();
+        }
+        uint64_t elapsed = std::max<uint64_t>(GetCurrentTimeMs() - startTime, 1);
+        double speed = 1000.0 * double(wordsNumber * threadsNumber) / double(elapsed);
+        if (threadsNumber == 1) {
+            singleThreadSpeed = speed;
+        }
+        std::cout << "threads: " << threadsNumber
+                  << ", time: " << elapsed << "ms"
+                  << ", words/s: " << uint64_t(speed)
+                  << ", speedup: " << speed / singleThreadSpeed << std::endl;
+    }
+    return 0;
+}
+
+// Builds the cache of a copy of the model, so the cache of the model itself is kept
+int BenchCache(const std::string& modelFile, size_t maxThreads) {
+    const std::string benchModelFile = modelFile + ".bench";
+    {
+        std::ifstream in(modelFile, std::ios::binary);
+        std::ofstream out(benchModelFile, std::ios::binary);
+        if (!in || !(out << in.rdbuf())) {
+            std::cerr << "[error] failed to copy model to " << benchModelFile << std::endl;
+            return 42;
+        }
+    }
+    const std::string cacheFile = benchModelFile + ".spell";
+    uint64_t singleThreadTime = 0;
+    int result = 0;
+    for (size_t threadsNumber = 1; threadsNumber <= maxThreads; ++threadsNumber) {
+        std::remove(cacheFile.c_str());
+        TSpellCorrector corrector;
+        corrector.SetCacheThreads(threadsNumber);
+        uint64_t startTime = GetCurrentTimeMs();
+        if (!corrector.LoadLangModel(benchModelFile)) {
+            std::cerr << "[error] failed to load model" << std::endl;
+            result = 42;
+            break;
+        }
+        uint64_t elapsed = std::max<uint64_t>(GetCurrentTimeMs() - startTime, 1);
+        if (threadsNumber == 1) {
+            singleThreadTime = elapsed;
+        }
+        std::cout << "threads: " << threadsNumber
+                  << ", time: " << elapsed << "ms"
+                  << ", speedup: " << double(singleThreadTime) / double(elapsed) << std::endl;
+    }
+    std::remove(cacheFile.c_str());
+    std::remove(benchModelFile.c_str());
+    return result;
+}
+
+// Trains in memory only, the model isn't saved
+int BenchTrain(const std::string& alphabetFile, const std::string& datasetFile, size_t maxThreads) {
+    uint64_t singleThreadTime = 0;
+    for (size_t threadsNumber = 1; threadsNumber <= maxThreads; ++threadsNumber) {
+        TLangModel model;
+        model.SetTrainThreads(threadsNumber);
+        uint64_t startTime = GetCurrentTimeMs();
+        if (!model.Train(datasetFile, alphabetFile)) {
+            std::cerr << "[error] failed to train model" << std::endl;
+            return 42;
+        }
+        uint64_t elapsed = std::max<uint64_t>(GetCurrentTimeMs() - startTime, 1);
+        if (threadsNumber == 1) {
+            singleThreadTime = elapsed;
+        }
+        std::cout << "threads: " << threadsNumber
+                  << ", time: " << elapsed << "ms"
+                  << ", speedup: " << double(singleThreadTime) / double(elapsed) << std::endl;
+    }
+    return 0;
+}
+
 int main(int argc, const char** argv) {
     if (argc < 2) {
         PrintUsage(argv);
@@ -92,7 +324,19 @@ int main(int argc, const char** argv) {
         std::string alphabetFile = argv[2];
         std::string datasetFile = argv[3];
         std::string resultModelFile = argv[4];
-        return Train(alphabetFile, datasetFile, resultModelFile);
+        TBucketLayouts layouts;
+        if (argc >= 6 && !ParseBucketLayouts(argv[5], layouts)) {
+            std::cerr << "[error] wrong layout: " << argv[5] << std::endl;
+            return 42;
+        }
+        uint64_t memoryLimit = 0;
+        if (argc >= 7 && !ParseNumber(argv[6], std::numeric_limits<uint64_t>::max() / (1024 * 1024), memoryLimit)) {
+            PrintUsage(argv);
+            return 42;
+        }
+        memoryLimit *= 1024 * 1024;
+        std::string tempDir = argc >= 8 ? argv[7] : ".";
+        return Train(alphabetFile, datasetFile, resultModelFile, layouts, memoryLimit, tempDir);
     } else if (mode == "score") {
         if (argc < 3) {
             PrintUsage(argv);
@@ -115,7 +359,86 @@ int main(int argc, const char** argv) {
         std::string modelFile = argv[2];
         std::string inFile = argv[3];
         std::string outFile = argv[4];
-        return Fix(modelFile, inFile, outFile);
+        ECandidatesEngine engine = CE_DELETES_BLOOM;
+        EDeletesFilter filter = DF_BLOCKED_BLOOM;
+        if (argc >= 6) {
+            std::string engineName = argv[5];
+            if (engineName == "xor") {
+                filter = DF_XOR;
+            } else if (engineName == "index") {
+                engine = CE_DELETES_INDEX;
+            } else if (engineName == "dawg") {
+                engine = CE_DAWG;
+            } else if (engineName != "bloom") {
+                std::cerr << "[error] wrong engine: " << engineName << std::endl;
+                return 42;
+            }
+        }
+        return Fix(modelFile, inFile, outFile, engine, filter);
+    } else if (mode == "candidates") {
+        if (argc < 4) {
+            PrintUsage(argv);
+            return 42;
+        }
+        std::string modelFile = argv[2];
+        std::string textFile = argv[3];
+        uint64_t maxWords = 100000;
+        if (argc >= 5 && !ParseNumber(argv[4], std::numeric_limits<uint32_t>::max(), maxWords)) {
+            PrintUsage(argv);
+            return 42;
+        }
+        bool knownWords = false;
+        if (argc >= 6) {
+            if (std::string(argv[5]) != "all") {
+                PrintUsage(argv);
+                return 42;
+            }
+            knownWords = true;
+        }
+        return Candidates(modelFile, textFile, maxWords, knownWords);
+    } else if (mode == "bench") {
+        if (argc < 4) {
+            PrintUsage(argv);
+            return 42;
+        }
+        std::string modelFile = argv[2];
+        std::string inFile = argv[3];
+        uint64_t maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+        if (argc >= 5 && (!ParseNumber(argv[4], 1024, maxThreads) || maxThreads == 0)) {
+            PrintUsage(argv);
+            return 42;
+        }
+        uint64_t cacheWords = 0;
+        if (argc >= 6 && !ParseNumber(argv[5], std::numeric_limits<uint32_t>::max(), cacheWords)) {
+            PrintUsage(argv);
+            return 42;
+        }
+        return Bench(modelFile, inFile, maxThreads, cacheWords);
+    } else if (mode == "bench-cache") {
+        if (argc < 3) {
+            PrintUsage(argv);
+            return 42;
+        }
+        std::string modelFile = argv[2];
+        uint64_t maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+        if (argc >= 4 && (!ParseNumber(argv[3], 1024, maxThreads) || maxThreads == 0)) {
+            PrintUsage(argv);
+            return 42;
+        }
+        return BenchCache(modelFile, maxThreads);
+    } else if (mode == "bench-train") {
+        if (argc < 4) {
+            PrintUsage(argv);
+            return 42;
+        }
+        std::string alphabetFile = argv[2];
+        std::string datasetFile = argv[3];
+        uint64_t maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+        if (argc >= 5 && (!ParseNumber(argv[4], 1024, maxThreads) || maxThreads == 0)) {
+            PrintUsage(argv);
+            return 42;
+        }
+        return BenchTrain(alphabetFile, datasetFile, maxThreads);
     }
 
     PrintUsage(argv);
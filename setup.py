@@ -19,10 +19,18 @@ jamspell = Extension(
         os.path.join('jamspell', 'utils.cpp'),
         os.path.join('jamspell', 'perfect_hash.cpp'),
         os.path.join('jamspell', 'bloom_filter.cpp'),
+        os.path.join('jamspell', 'xor_filter.cpp'),
+        os.path.join('jamspell', 'mapped_file.cpp'),
+        os.path.join('jamspell', 'vocabulary.cpp'),
+        os.path.join('jamspell', 'gram_table.cpp'),
+        os.path.join('jamspell', 'deletes_index.cpp'),
+        os.path.join('jamspell', 'dawg.cpp'),
+        os.path.join('jamspell', 'candidates_table.cpp'),
         os.path.join('contrib', 'cityhash', 'city.cc'),
         os.path.join('contrib', 'phf', 'phf.cc'),
         os.path.join('jamspell.i'),
     ],
+    define_macros=[('PHF_NO_COMPUTED_GOTOS', '1')],
     extra_compile_args=['-std=c++11', '-O2'],
     swig_opts=['-c++', '-py3'],
 )
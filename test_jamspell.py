@@ -30,6 +30,17 @@ def trainLangModel(trainText, alphabetFile, modelFile):
     corrector = jamspell.TSpellCorrector()
     corrector.TrainLangModel(trainText, alphabetFile, modelFile)
 
+def test_cacheSettings():
+    corrector = jamspell.TSpellCorrector()
+    assert corrector.SetDeletesCacheLimits(0.001, 2 ** 40)
+    assert not corrector.SetDeletesCacheLimits(0.0)
+    corrector.SetCandidatesCacheSize(1000)
+    assert corrector.TrainLangModel(TEST_DATA + 'sherlockholmes.txt', TEST_DATA + 'alphabet_en.txt', TEMP_MODEL)
+    corrector.FixFragment('i am the begt spell cherken')
+    stats = corrector.GetCandidatesCacheStats()
+    assert stats.Hits + stats.Misses > 0
+    assert stats.Size > 0
+
 @pytest.mark.parametrize('sourceFile,alphabetFile,expected', [
     ('sherlockholmes.txt', 'alphabet_en.txt', (0.04538662682106836, 0.6987951807228916, 0.014246804944479363,
                                                0.013821441912588718, 0.76592082616179)),
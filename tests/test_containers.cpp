@@ -0,0 +1,155 @@
+#include <gtest/gtest.h>
+
+#include <map>
+#include <sstream>
+#include <string>
+
+#include <jamspell/bloom_filter.hpp>
+#include <jamspell/xor_filter.hpp>
+#include <jamspell/lru_cache.hpp>
+#include <jamspell/gram_counts.hpp>
+#include <jamspell/gram_runs.hpp>
+
+TEST(BloomFilterTest, blockedFalsePositives) {
+    const size_t elements = 100000;
+    NJamSpell::TBlockedBloomFilter filter(elements, 0.001);
+    for (size_t i = 0; i < elements; ++i) {
+        std::string key = "key" + std::to_string(i);
+        filter.Insert(key.data(), key.size());
+    }
+    for (size_t i = 0; i < elements; ++i) {
+        std::string key = "key" + std::to_string(i);
+        ASSERT_TRUE(filter.Contains(key.data(), key.size()));
+    }
+    size_t falsePositives = 0;
+    for (size_t i = 0; i < elements; ++i) {
+        std::string key = "other" + std::to_string(i);
+        falsePositives += filter.Contains(key.data(), key.size());
+    }
+    ASSERT_LT(falsePositives, elements * 0.0015);
+
+    std::stringstream params;
+    filter.DumpParams(params);
+    NJamSpell::TBlockedBloomFilter mapped;
+    mapped.LoadParams(params);
+    ASSERT_EQ(filter.TableSize(), mapped.TableSize());
+    std::string table(filter.TableData(), filter.TableSize());
+    mapped.SetTable(table.data());
+    for (size_t i = 0; i < elements; i += 7) {
+        std::string key = "key" + std::to_string(i);
+        ASSERT_TRUE(mapped.Contains(key.data(), key.size()));
+    }
+}
+
+TEST(XorFilterTest, falsePositives) {
+    const size_t elements = 100000;
+    NJamSpell::TXorFilter filter(0.001);
+    for (size_t i = 0; i < elements; ++i) {
+        std::string key = "key" + std::to_string(i % (elements / 2)); // duplicates are allowed
+        filter.Insert(key.data(), key.size());
+    }
+    ASSERT_TRUE(filter.Finish());
+    ASSERT_LT(filter.TableSize(), elements / 2 * 10 * 1.25 / 8 + 64);
+    for (size_t i = 0; i < elements / 2; ++i) {
+        std::string key = "key" + std::to_string(i);
+        ASSERT_TRUE(filter.Contains(key.data(), key.size()));
+    }
+    size_t falsePositives = 0;
+    for (size_t i = 0; i < elements; ++i) {
+        std::string key = "other" + std::to_string(i);
+        falsePositives += filter.Contains(key.data(), key.size());
+    }
+    ASSERT_LT(falsePositives, elements * 0.0015);
+
+    std::stringstream params;
+    filter.DumpParams(params);
+    NJamSpell::TXorFilter mapped;
+    mapped.LoadParams(params);
+    ASSERT_EQ(filter.TableSize(), mapped.TableSize());
+    std::string table(filter.TableData(), filter.TableSize());
+    mapped.SetTable(table.data());
+    for (size_t i = 0; i < elements / 2; i += 7) {
+        std::string key = "key" + std::to_string(i);
+        ASSERT_TRUE(mapped.Contains(key.data(), key.size()));
+    }
+}
+
+TEST(LruCacheTest, evictsLeastRecentlyUsed) {
+    NJamSpell::TLruCache<int, int> cache(2, 1);
+    cache.Put(1, 10);
+    cache.Put(2, 20);
+    int value = 0;
+    ASSERT_TRUE(cache.Get(1, value));
+    ASSERT_EQ(10, value);
+    cache.Put(3, 30);
+    ASSERT_FALSE(cache.Get(2, value));
+    ASSERT_TRUE(cache.Get(3, value));
+    ASSERT_EQ(30, value);
+    cache.Put(1, 11);
+    ASSERT_TRUE(cache.Get(1, value));
+    ASSERT_EQ(11, value);
+
+    NJamSpell::TLruCacheStats stats = cache.GetStats();
+    ASSERT_EQ(3u, stats.Hits);
+    ASSERT_EQ(1u, stats.Misses);
+    ASSERT_EQ(1u, stats.Evictions);
+    ASSERT_EQ(2u, stats.Size);
+
+    NJamSpell::TLruCache<int, int> sharded(100);
+    for (int i = 0; i < 1000; ++i) {
+        sharded.Put(i, i);
+    }
+    stats = sharded.GetStats();
+    ASSERT_EQ(100u, stats.Size);
+    ASSERT_EQ(900u, stats.Evictions);
+}
+
+TEST(GramCountsTest, countsAcrossRehashes) {
+    NJamSpell::TGramCounts<3> counts;
+    std::map<std::array<NJamSpell::TWordId, 3>, NJamSpell::TCount> expected;
+    for (uint32_t i = 0; i < 10000; ++i) {
+        std::array<NJamSpell::TWordId, 3> words = {{i % 7, i % 101, i % 997}};
+        counts.Add(words);
+        expected[words] += 1;
+    }
+    ASSERT_EQ(expected.size(), counts.Size());
+    size_t seen = 0;
+    counts.ForEach([&](const NJamSpell::TGramRecord<3>& record) {
+        ASSERT_EQ(expected[record.Words], record.Count);
+        ++seen;
+    });
+    ASSERT_EQ(expected.size(), seen);
+
+    std::vector<NJamSpell::TGramRecord<3>> records = counts.Release();
+    ASSERT_EQ(expected.size(), records.size());
+    ASSERT_EQ(0u, counts.Size());
+}
+
+TEST(GramRunsTest, mergesOverlappingRuns) {
+    std::map<std::array<NJamSpell::TWordId, 2>, NJamSpell::TCount> expected;
+    NJamSpell::TGramRuns runs;
+    for (uint32_t run = 0; run < 5; ++run) {
+        NJamSpell::TGramCounts<2> counts;
+        for (uint32_t i = 0; i < 1000; ++i) {
+            std::array<NJamSpell::TWordId, 2> words = {{i % 13 + 1, (i * run) % 31}};
+            counts.Add(words);
+            expected[words] += 1;
+        }
+        std::vector<NJamSpell::TGramRecord<2>> records = counts.Release();
+        ASSERT_TRUE(NJamSpell::WriteGramRun(records, "test_run_" + std::to_string(run) + ".tmp", runs));
+    }
+    size_t gramsNumber = 0;
+    ASSERT_TRUE(NJamSpell::MergeGramRunsToOne<2>(runs, "test_run_merged_", 2, gramsNumber)); // three passes
+    ASSERT_EQ(1u, runs.Files.size());
+    ASSERT_EQ(expected.size(), gramsNumber);
+
+    auto it = expected.begin();
+    ASSERT_TRUE(NJamSpell::MergeGramRuns<2>(runs.Files, [&](const std::array<NJamSpell::TWordId, 2>& words,
+                                                             NJamSpell::TCount count) {
+        ASSERT_TRUE(it != expected.end());
+        ASSERT_EQ(it->first, words);
+        ASSERT_EQ(it->second, count);
+        ++it;
+    }));
+    ASSERT_TRUE(it == expected.end());
+}
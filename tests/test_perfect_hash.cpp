@@ -1,6 +1,10 @@
 #include <gtest/gtest.h>
 
+#include <random>
+#include <unordered_set>
+
 #include <jamspell/perfect_hash.hpp>
+#include <jamspell/gram_table.hpp>
 #include <contrib/handypack/handypack.hpp>
 
 TEST(PerfetHashTest, basicFlow) {
@@ -44,3 +48,92 @@ TEST(PerfetHashTest, basicFlow) {
     }
     ASSERT_EQ(keys.size(), bucketsUsed.size());
 }
+
+TEST(PerfetHashTest, emptyKeys) {
+    NJamSpell::TPerfectHash ph;
+    ASSERT_FALSE(ph.Init(std::vector<uint64_t>()));
+    ASSERT_FALSE(ph.Init(std::vector<std::string>()));
+}
+
+TEST(PerfetHashTest, twoStepHash) {
+    NJamSpell::TPerfectHash ph;
+    std::vector<uint64_t> keys;
+    for (uint64_t i = 0; i < 10000; ++i) {
+        keys.push_back(i * 0x9e3779b97f4a7c15ULL + 17);
+    }
+    ASSERT_TRUE(ph.Init(keys));
+
+    std::set<uint32_t> bucketsUsed;
+    for (auto&& k: keys) {
+        uint32_t bucket = ph.Hash(k);
+        ASSERT_EQ(bucket, ph.Hash(k, ph.DisplacementSlot(k)));
+        ASSERT_TRUE(bucket < ph.BucketsNumber());
+        bucketsUsed.insert(bucket);
+    }
+    ASSERT_EQ(keys.size(), bucketsUsed.size());
+}
+
+// The two-step lookup reimplements phf internals, it must stay in sync with
+// PHF::hash (behind Hash(uint64_t)) for members and other values alike
+TEST(PerfetHashTest, twoStepHashMatchesPhf) {
+    std::mt19937_64 random(42);
+    for (size_t size: {10, 3000, 200000}) {
+        std::unordered_set<uint64_t> unique;
+        while (unique.size() < size) {
+            unique.insert(random());
+        }
+        std::vector<uint64_t> keys(unique.begin(), unique.end());
+        NJamSpell::TPerfectHash ph;
+        ASSERT_TRUE(ph.Init(keys));
+        for (auto&& k: keys) {
+            ASSERT_EQ(ph.Hash(k), ph.Hash(k, ph.DisplacementSlot(k)));
+        }
+        for (size_t i = 0; i < 10000; ++i) {
+            uint64_t k = random();
+            ASSERT_EQ(ph.Hash(k), ph.Hash(k, ph.DisplacementSlot(k)));
+        }
+    }
+}
+
+TEST(GramTableTest, packedLayouts) {
+    NJamSpell::TBucketLayouts layouts;
+    ASSERT_TRUE(NJamSpell::ParseBucketLayouts("12:10,8:6", layouts));
+    ASSERT_EQ(12, layouts[0].FingerprintBits);
+    ASSERT_EQ(6, layouts[1].CountBits);
+    ASSERT_TRUE(NJamSpell::ParseBucketLayouts("20:12", layouts));
+    ASSERT_EQ(20, layouts[1].FingerprintBits);
+    ASSERT_FALSE(NJamSpell::ParseBucketLayouts("40:30", layouts));
+    ASSERT_FALSE(NJamSpell::ParseBucketLayouts("16:20", layouts));
+    for (auto&& layout: {"0:12", "7:16", "25:16", "32:16", "16:0", "16:1", "16:5", "12:10,0:10", "12:10,12:5"}) {
+        ASSERT_FALSE(NJamSpell::ParseBucketLayouts(layout, layouts)) << layout;
+    }
+    ASSERT_FALSE(NJamSpell::ParseBucketLayouts("16:16,16:16,16:16", layouts));
+
+    std::vector<uint64_t> keys;
+    for (uint64_t i = 1; i <= 5000; ++i) {
+        keys.push_back(i * 0xc2b2ae3d27d4eb4fULL);
+    }
+    for (auto&& layout: {"16:16", "24:8", "8:6", "24:16"}) {
+        ASSERT_TRUE(NJamSpell::ParseBucketLayouts(layout, layouts));
+        NJamSpell::TGramTable table;
+        ASSERT_TRUE(table.Init(keys, 1000, layouts[0]));
+        for (size_t i = 0; i < keys.size(); ++i) {
+            table.Set(keys[i], i % 1000 + 1);
+        }
+        for (size_t i = 0; i < keys.size(); ++i) {
+            NJamSpell::TCount count = table.Get(keys[i]);
+            ASSERT_EQ(count, table.Get(keys[i], table.Bucket(keys[i], table.DisplacementSlot(keys[i]))));
+            // small counts are exact, large ones are within quantization error
+            if (i % 1000 < 2) {
+                ASSERT_EQ(i % 1000 + 1, count);
+            }
+            ASSERT_NEAR(double(i % 1000 + 1), double(count), (i % 1000 + 1) * 0.5);
+        }
+        // the largest count set for a key is kept
+        table.Set(keys[1], 1);
+        ASSERT_EQ(2u, table.Get(keys[1]));
+        table.Set(keys[0], 2);
+        ASSERT_EQ(2u, table.Get(keys[0]));
+    }
+}
+
@@ -0,0 +1,431 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+#include <atomic>
+
+#include <jamspell/spell_corrector.hpp>
+
+using namespace NJamSpell;
+
+static const std::string TEST_MODEL = "test_model_en.bin";
+
+TEST(UtilsTest, wideToUTF8Buffer) {
+    std::string buffer;
+    for (auto&& text: {std::wstring(L""), std::wstring(L"sherlock"), std::wstring(L"\u0451\u0436\u0438\u043a"),
+                       std::wstring(L"na\u00efve \u20ac5"), std::wstring(1, wchar_t(0x1F600))})
+    {
+        WideToUTF8(text.data(), text.size(), buffer);
+        ASSERT_EQ(WideToUTF8(text), buffer);
+    }
+}
+
+TEST(MappedFileTest, concurrentWriters) {
+    const std::string fileName = "test_sections.bin";
+    const size_t size = 100000;
+    std::vector<std::thread> threads;
+    for (char c: {'a', 'b', 'c', 'd'}) {
+        threads.emplace_back([&fileName, size, c]() {
+            std::string data(size, c);
+            for (int i = 0; i < 10; ++i) {
+                TSectionsWriter writer;
+                writer.Add(1, data);
+                ASSERT_TRUE(writer.Write(fileName, 42, 1));
+            }
+        });
+    }
+    for (auto&& t: threads) {
+        t.join();
+    }
+    {
+        TMappedSections sections;
+        ASSERT_TRUE(sections.Open(fileName, 42, 1));
+        const char* data = nullptr;
+        size_t dataSize = 0;
+        ASSERT_TRUE(sections.Get(1, data, dataSize));
+        ASSERT_EQ(size, dataSize);
+        ASSERT_EQ(std::string(size, data[0]), std::string(data, dataSize)); // written by one of the threads
+    }
+    uint16_t version = 0;
+    ASSERT_TRUE(ReadFileVersion(fileName, 42, version));
+    ASSERT_EQ(1, version);
+    ASSERT_FALSE(ReadFileVersion(fileName, 43, version));
+    std::remove(fileName.c_str());
+}
+
+TEST(UtilsTest, alphabetCodec) {
+    TAlphabetCodec codec;
+    ASSERT_TRUE(codec.Init({L'c', L'a', L'b', L'\u0451'}));
+    ASSERT_EQ(4u, codec.LettersNumber());
+    std::string coded;
+    codec.Encode(L"ab\u0451c", 4, coded);
+    ASSERT_EQ(std::string("\x01\x02\x04\x03"), coded);
+    codec.Encode(L"aXb", 3, coded);
+    ASSERT_EQ(std::string("\x01\x00\x02", 3), coded);
+    std::wstring decoded;
+    codec.Decode("\x03\x04", 2, decoded);
+    ASSERT_EQ(L"c\u0451", decoded);
+
+    std::unordered_set<wchar_t> large;
+    for (wchar_t c = 0x400; c < 0x500; ++c) {
+        large.insert(c);
+    }
+    ASSERT_FALSE(codec.Init(large));
+}
+
+class SpellCorrectorTest: public ::testing::Test {
+protected:
+    static void SetUpTestCase() {
+        Corrector = new TSpellCorrector();
+        ASSERT_TRUE(Corrector->TrainLangModel(std::string(TEST_DATA_DIR) + "sherlockholmes.txt",
+                                              std::string(TEST_DATA_DIR) + "alphabet_en.txt",
+                                              TEST_MODEL));
+    }
+    static void TearDownTestCase() {
+        delete Corrector;
+        Corrector = nullptr;
+        std::remove(TEST_MODEL.c_str());
+        std::remove((TEST_MODEL + ".spell").c_str());
+        std::remove((TEST_MODEL + ".deletes").c_str());
+        std::remove((TEST_MODEL + ".dawg").c_str());
+    }
+    static TSpellCorrector* Corrector;
+};
+
+TSpellCorrector* SpellCorrectorTest::Corrector = nullptr;
+
+static const std::vector<std::wstring> TEST_FRAGMENTS = {
+    L"To Sherlok Holmes she is alwys THE woman.",
+    L"I have seldm heard him mention her undr any other name.",
+    L"In his eyes she eclipsis and predominats the whole of her sex.",
+    L"He was, I take it, the most perfet reasoning and observng machine.",
+    L"It was not that he felt any emotoin akin to love for Irene Adler.",
+};
+
+TEST_F(SpellCorrectorTest, fixFragment) {
+    ASSERT_EQ(L"To Sherlock Holmes she is always THE woman.", Corrector->FixFragment(TEST_FRAGMENTS[0]));
+    ASSERT_EQ(L"I have seldom heard him mention her under any other name.", Corrector->FixFragment(TEST_FRAGMENTS[1]));
+}
+
+TEST_F(SpellCorrectorTest, loadSavedModel) {
+    TSpellCorrector loaded;
+    ASSERT_TRUE(loaded.LoadLangModel(TEST_MODEL));
+    for (auto&& fragment: TEST_FRAGMENTS) {
+        ASSERT_EQ(Corrector->FixFragment(fragment), loaded.FixFragment(fragment));
+        ASSERT_EQ(Corrector->GetLangModel().Score(fragment), loaded.GetLangModel().Score(fragment));
+    }
+}
+
+TEST_F(SpellCorrectorTest, deletesIndexEngine) {
+    for (int i = 0; i < 2; ++i) { // builds the index, then loads it
+        TSpellCorrector indexed;
+        indexed.SetCandidatesEngine(CE_DELETES_INDEX);
+        ASSERT_TRUE(indexed.LoadLangModel(TEST_MODEL));
+        for (auto&& fragment: TEST_FRAGMENTS) {
+            ASSERT_EQ(Corrector->FixFragment(fragment), indexed.FixFragment(fragment));
+        }
+        std::vector<std::wstring> sentence = {L"shrlck", L"hlms"}; // two edits away
+        for (size_t position = 0; position < sentence.size(); ++position) {
+            std::vector<std::wstring> expected = Corrector->GetCandidates(sentence, position);
+            std::vector<std::wstring> candidates = indexed.GetCandidates(sentence, position);
+            std::sort(expected.begin(), expected.end());
+            std::sort(candidates.begin(), candidates.end());
+            ASSERT_FALSE(candidates.empty());
+            ASSERT_EQ(expected, candidates);
+        }
+    }
+}
+
+TEST_F(SpellCorrectorTest, xorDeletesFilter) {
+    const std::string model = "test_model_xor.bin";
+    SaveFile(model, LoadFile(TEST_MODEL));
+    for (int i = 0; i < 2; ++i) { // builds the cache, then loads it
+        TSpellCorrector corrector;
+        corrector.SetDeletesFilter(DF_XOR);
+        ASSERT_TRUE(corrector.LoadLangModel(model));
+        for (auto&& fragment: TEST_FRAGMENTS) {
+            ASSERT_EQ(Corrector->FixFragment(fragment), corrector.FixFragment(fragment));
+        }
+        std::vector<std::wstring> sentence = {L"shrlck", L"hlms"};
+        ASSERT_EQ(Corrector->GetCandidates(sentence, 0), corrector.GetCandidates(sentence, 0));
+    }
+    std::remove(model.c_str());
+    std::remove((model + ".spell").c_str());
+}
+
+TEST_F(SpellCorrectorTest, parallelCache) {
+    const std::string model = "test_model_threads.bin";
+    SaveFile(model, LoadFile(TEST_MODEL));
+    ASSERT_GT(Corrector->GetLangModel().GetWordsNumber(), 3 * 2000u);
+    for (auto&& filter: {DF_BLOOM, DF_BLOCKED_BLOOM, DF_XOR}) {
+        std::string cache;
+        for (size_t threads: {1, 3}) {
+            std::remove((model + ".spell").c_str());
+            TSpellCorrector corrector;
+            corrector.SetDeletesFilter(filter);
+            corrector.SetCacheThreads(threads);
+            ASSERT_TRUE(corrector.LoadLangModel(model));
+            if (threads == 1) {
+                cache = LoadFile(model + ".spell");
+            } else {
+                ASSERT_EQ(cache, LoadFile(model + ".spell"));
+            }
+        }
+    }
+    std::remove(model.c_str());
+    std::remove((model + ".spell").c_str());
+}
+
+static void AssertSameModel(const TLangModel& expected, const TLangModel& model) {
+    ASSERT_EQ(expected.GetWordsNumber(), model.GetWordsNumber());
+    for (TWordId wid = 0; wid < model.GetWordsNumber(); ++wid) {
+        TWord w = expected.GetWordById(wid);
+        ASSERT_EQ(std::wstring(w.Ptr, w.Len), std::wstring(model.GetWordById(wid).Ptr, model.GetWordById(wid).Len));
+        ASSERT_EQ(expected.GetWordCount(wid), model.GetWordCount(wid));
+    }
+    for (auto&& fragment: TEST_FRAGMENTS) {
+        ASSERT_EQ(expected.Score(fragment), model.Score(fragment));
+    }
+}
+
+TEST_F(SpellCorrectorTest, parallelTrain) {
+    TLangModel model;
+    model.SetTrainThreads(3);
+    model.SetTrainChunkSize(4096); // batches of three chunks, each with words new to the vocabulary
+    ASSERT_TRUE(model.Train(std::string(TEST_DATA_DIR) + "sherlockholmes.txt",
+                            std::string(TEST_DATA_DIR) + "alphabet_en.txt"));
+    AssertSameModel(Corrector->GetLangModel(), model);
+}
+
+TEST_F(SpellCorrectorTest, chunkedTrain) {
+    TLangModel model;
+    model.SetTrainThreads(1);
+    model.SetTrainChunkSize(4096); // longer than any sentence, so chunks are cut between sentences
+    ASSERT_TRUE(model.Train(std::string(TEST_DATA_DIR) + "sherlockholmes.txt",
+                            std::string(TEST_DATA_DIR) + "alphabet_en.txt"));
+    AssertSameModel(Corrector->GetLangModel(), model);
+}
+
+TEST_F(SpellCorrectorTest, externalMemoryTrain) {
+    const std::string text = std::string(TEST_DATA_DIR) + "sherlockholmes.txt";
+    const std::string alphabet = std::string(TEST_DATA_DIR) + "alphabet_en.txt";
+    TLangModel model;
+    model.SetTrainThreads(3);
+    model.SetTrainChunkSize(4096);
+    model.SetTrainMemoryLimit(1); // less than the vocabulary
+    ASSERT_FALSE(model.Train(text, alphabet));
+
+    model.SetTrainMemoryLimit(1000000); // counters of every shard are spilled many times
+    ASSERT_TRUE(model.Train(text, alphabet));
+    AssertSameModel(Corrector->GetLangModel(), model);
+
+    model.SetTrainMemoryLimit(1000000, "no_such_dir");
+    ASSERT_FALSE(model.Train(text, alphabet));
+}
+
+TEST_F(SpellCorrectorTest, deletesCacheLimit) {
+    const std::string model = "test_model_limit.bin";
+    SaveFile(model, LoadFile(TEST_MODEL));
+    const uint64_t maxSize = 200000;
+    TSpellCorrector corrector;
+    ASSERT_FALSE(corrector.SetDeletesCacheLimits(0.0, maxSize));
+    ASSERT_FALSE(corrector.SetDeletesCacheLimits(1.0, maxSize));
+    ASSERT_TRUE(corrector.SetDeletesCacheLimits(0.001, maxSize));
+    ASSERT_TRUE(corrector.LoadLangModel(model));
+    ASSERT_LT(LoadFile(model + ".spell").size(), maxSize + 1024);
+    for (auto&& fragment: TEST_FRAGMENTS) {
+        ASSERT_EQ(Corrector->FixFragment(fragment), corrector.FixFragment(fragment));
+    }
+    std::remove((model + ".spell").c_str());
+
+    // Too small for any rate, no oversized cache is built
+    TSpellCorrector tooSmall;
+    ASSERT_TRUE(tooSmall.SetDeletesCacheLimits(0.001, 1000));
+    ASSERT_FALSE(tooSmall.LoadLangModel(model));
+    ASSERT_TRUE(LoadFile(model + ".spell").empty());
+    std::remove(model.c_str());
+}
+
+TEST_F(SpellCorrectorTest, candidatesCache) {
+    TSpellCorrector corrector;
+    corrector.SetCandidatesCacheSize(1000);
+    ASSERT_TRUE(corrector.LoadLangModel(TEST_MODEL));
+    for (int i = 0; i < 2; ++i) {
+        for (auto&& fragment: TEST_FRAGMENTS) {
+            ASSERT_EQ(Corrector->FixFragment(fragment), corrector.FixFragment(fragment));
+        }
+        std::vector<std::wstring> sentence = {L"shrlck", L"hlms"};
+        ASSERT_EQ(Corrector->GetCandidatesWithScores(sentence, 0), corrector.GetCandidatesWithScores(sentence, 0));
+    }
+    TLruCacheStats stats = corrector.GetCandidatesCacheStats();
+    ASSERT_EQ(stats.Misses, stats.Size);
+    ASSERT_GE(stats.Hits, stats.Misses); // all hits on the second pass
+    ASSERT_EQ(0u, stats.Evictions);
+
+    corrector.SetCandidatesCacheSize(2);
+    for (auto&& fragment: TEST_FRAGMENTS) {
+        ASSERT_EQ(Corrector->FixFragment(fragment), corrector.FixFragment(fragment));
+    }
+    stats = corrector.GetCandidatesCacheStats();
+    ASSERT_EQ(2u, stats.Size);
+    ASSERT_GT(stats.Evictions, 0u);
+}
+
+TEST_F(SpellCorrectorTest, candidatesTable) {
+    const std::string model = "test_model_table.bin";
+    const std::string text = "test_table_text.txt";
+    SaveFile(model, LoadFile(TEST_MODEL));
+    std::wstring fragments;
+    for (auto&& fragment: TEST_FRAGMENTS) {
+        fragments += fragment + L"\n";
+    }
+    SaveFile(text, WideToUTF8(fragments));
+    {
+        TSpellCorrector corrector;
+        ASSERT_TRUE(corrector.LoadLangModel(model));
+        ASSERT_TRUE(corrector.BuildCandidatesTable(text, 5, model));
+    }
+
+    TCandidatesTable table;
+    ASSERT_TRUE(table.Load(model + ".candidates", Corrector->GetLangModel().GetCheckSum()));
+    ASSERT_EQ(5u, table.Size());
+    ASSERT_EQ(CE_DELETES_BLOOM, table.GetCandidatesEngine());
+    TWordCandidates candidates;
+    ASSERT_TRUE(table.Find(L"alwys", 5, candidates));
+    ASSERT_FALSE(table.Find(L"always", 6, candidates));
+
+    TSpellCorrector corrector;
+    ASSERT_TRUE(corrector.LoadLangModel(model));
+    for (auto&& fragment: TEST_FRAGMENTS) {
+        ASSERT_EQ(Corrector->FixFragment(fragment), corrector.FixFragment(fragment));
+    }
+    std::remove(model.c_str());
+    std::remove((model + ".spell").c_str());
+    std::remove((model + ".candidates").c_str());
+    std::remove(text.c_str());
+}
+
+TEST_F(SpellCorrectorTest, dawgVocabulary) {
+    const TLangModel& model = Corrector->GetLangModel();
+    TDawg dawg;
+    dawg.Build(model);
+    ASSERT_EQ(model.GetWordsNumber(), dawg.Size());
+    for (TWordId wid = 0; wid < model.GetWordsNumber(); ++wid) {
+        TWord word = model.GetWordById(wid);
+        ASSERT_EQ(wid, dawg.Find(word.Ptr, word.Len));
+        ASSERT_EQ(std::wstring(word.Ptr, word.Len), dawg.GetWord(wid));
+    }
+    ASSERT_EQ(UNKNOWN_WORD_ID, dawg.Find(L"sherlck", 7));
+    ASSERT_EQ(UNKNOWN_WORD_ID, dawg.Find(L"sherlockk", 9));
+}
+
+TEST_F(SpellCorrectorTest, dawgEngine) {
+    for (int i = 0; i < 2; ++i) { // builds the automaton, then loads it
+        TSpellCorrector dawg;
+        dawg.SetCandidatesEngine(CE_DAWG);
+        ASSERT_TRUE(dawg.LoadLangModel(TEST_MODEL));
+        for (auto&& fragment: TEST_FRAGMENTS) {
+            ASSERT_EQ(Corrector->FixFragment(fragment), dawg.FixFragment(fragment));
+        }
+        std::vector<std::wstring> sentence = {L"sherlck", L"holms"}; // one edit away
+        for (size_t position = 0; position < sentence.size(); ++position) {
+            std::vector<std::wstring> expected = Corrector->GetCandidates(sentence, position);
+            std::vector<std::wstring> candidates = dawg.GetCandidates(sentence, position);
+            std::sort(expected.begin(), expected.end());
+            std::sort(candidates.begin(), candidates.end());
+            ASSERT_FALSE(candidates.empty());
+            ASSERT_EQ(expected, candidates);
+        }
+    }
+}
+
+TEST_F(SpellCorrectorTest, scoreCandidatesAtPosition) {
+    const TLangModel& model = Corrector->GetLangModel();
+    TWords sentence = model.Tokenize(TEST_FRAGMENTS[3])[0];
+    TWords candidates = {model.GetWord(L"perfect"), model.GetWord(L"perfet"), model.GetWord(L"the")};
+    for (size_t position = 0; position < sentence.size(); ++position) {
+        std::vector<double> scores = model.ScoreCandidatesAtPosition(sentence, position, candidates);
+        ASSERT_EQ(candidates.size(), scores.size());
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            TWords window;
+            for (size_t j = position >= 2 ? position - 2 : 0; j < sentence.size() && j <= position + 2; ++j) {
+                window.push_back(j == position ? candidates[i] : sentence[j]);
+            }
+            ASSERT_NEAR(model.Score(window), scores[i], 1e-9);
+        }
+    }
+}
+
+TEST_F(SpellCorrectorTest, wordIds) {
+    const TLangModel& model = Corrector->GetLangModel();
+    std::wstring text = L"holmes said nothng";
+    TWords words = model.Tokenize(text)[0];
+    ASSERT_EQ(UNRESOLVED_WORD_ID, words[0].Id);
+    double score = model.Score(words);
+    model.ResolveWordIds(words);
+    ASSERT_EQ(model.GetWord(L"holmes").Id, words[0].Id);
+    ASSERT_EQ(model.GetWord(L"said").Id, words[1].Id);
+    ASSERT_EQ(UNKNOWN_WORD_ID, words[2].Id);
+    ASSERT_EQ(score, model.Score(words));
+}
+
+TEST_F(SpellCorrectorTest, concurrentReads) {
+    std::vector<std::wstring> expectedFixes;
+    std::vector<double> expectedScores;
+    const std::vector<std::wstring> sentence = {L"the", L"most", L"perfet", L"reasoning"};
+    std::vector<std::wstring> expectedCandidates = Corrector->GetCandidates(sentence, 2);
+    for (auto&& fragment: TEST_FRAGMENTS) {
+        expectedFixes.push_back(Corrector->FixFragment(fragment));
+        expectedScores.push_back(Corrector->GetLangModel().Score(fragment));
+    }
+
+    // Candidates cache much smaller than the words of the fragments, so
+    // threads evict each other's entries
+    const size_t cacheSize = 8;
+    TSpellCorrector cached;
+    ASSERT_TRUE(cached.LoadLangModel(TEST_MODEL));
+    std::vector<uint64_t> fragmentLookups;
+    for (auto&& fragment: TEST_FRAGMENTS) {
+        cached.SetCandidatesCacheSize(cacheSize);
+        ASSERT_EQ(expectedFixes[fragmentLookups.size()], cached.FixFragment(fragment));
+        TLruCacheStats stats = cached.GetCandidatesCacheStats();
+        fragmentLookups.push_back(stats.Hits + stats.Misses);
+    }
+    cached.SetCandidatesCacheSize(cacheSize);
+
+    const size_t threadsNum = 8;
+    const size_t iterations = 20;
+    std::atomic<size_t> mismatches(0);
+    uint64_t lookups = 0;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < threadsNum; ++t) {
+        for (size_t i = 0; i < iterations; ++i) {
+            lookups += fragmentLookups[(t + i) % TEST_FRAGMENTS.size()] + 1;
+        }
+        threads.emplace_back([&, t]() {
+            for (size_t i = 0; i < iterations; ++i) {
+                size_t n = (t + i) % TEST_FRAGMENTS.size();
+                for (const TSpellCorrector* corrector: {Corrector, &cached}) {
+                    if (corrector->FixFragment(TEST_FRAGMENTS[n]) != expectedFixes[n]) {
+                        mismatches += 1;
+                    }
+                    if (corrector->GetLangModel().Score(TEST_FRAGMENTS[n]) != expectedScores[n]) {
+                        mismatches += 1;
+                    }
+                    if (corrector->GetCandidates(sentence, 2) != expectedCandidates) {
+                        mismatches += 1;
+                    }
+                }
+            }
+        });
+    }
+    for (auto&& t: threads) {
+        t.join();
+    }
+    ASSERT_EQ(0u, mismatches.load());
+    TLruCacheStats stats = cached.GetCandidatesCacheStats();
+    ASSERT_EQ(lookups, stats.Hits + stats.Misses);
+    ASSERT_GT(stats.Evictions, 0u);
+    ASSERT_LE(stats.Size, cacheSize);
+}